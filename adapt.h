@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+/* Adaptive quality.
+ *
+ * Over ssh or a serial console the terminal can take bytes slower than
+ * frames make them; write() then blocks until the pty drains, and every
+ * frame after it is late. The output stage tells the controller how big
+ * each frame was, how long writing it took and how many frames were
+ * dropped for being late in between. Once per ADAPT_WINDOW_MS the
+ * controller works out the load: the share of the time spent blocked in
+ * write(), scaled up by the frames that should have been written over the
+ * ones that were, or the bytes per second against the -bw budget if that
+ * is higher. After ADAPT_DOWN_WINDOWS windows in a row over ADAPT_LOAD_HIGH
+ * it steps down, as far as it takes to bring the load under that, so a
+ * single full repaint doesn't count. It only steps back up after
+ * ADAPT_UP_WINDOWS windows in a row in which the step up would have kept
+ * the load under ADAPT_LOAD_LOW. The window after a step isn't counted,
+ * since frames made before it are still coming out.
+ *
+ * Under what the terminal can take, the pty's buffer takes every write at
+ * once, so the time spent in write() says nothing about how close to the
+ * limit a step up would go. The bytes per second seen while overloaded
+ * stand in for the limit until ADAPT_PROBE_WINDOWS windows have gone by
+ * without overload; then the controller tries the step up again, in case
+ * the link got faster. That doesn't happen while a loop cache is being
+ * filled or played: stepping up would throw the cache away, so there the
+ * controller only steps down.
+ *
+ * Going down, the steps are fewer truecolor bits, 256 colors, then a
+ * smaller grid and a lower frame rate by turns; each cuts the bytes by a
+ * third to a half. The top step is what the options asked for, so -w, -h,
+ * -f, -c and -tb are never exceeded.
+ */
+
+struct quality_t {
+    unsigned scale;     // percent of the grid's width and height
+    unsigned rate;      // one frame in `rate` is shown
+    bool palette;       // 256 colors
+    unsigned bits;      // per channel, in truecolor
+    double cost;        // bytes per second next to the top step, roughly
+};
+
+class QualityController {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  private:
+    std::vector<quality_t> ladder;
+    std::atomic<unsigned> level{0};
+    double budget = 0;          // bytes per second, 0 for none
+    clock::time_point windowStart;
+    double blocked = 0;         // seconds spent in write() this window
+    size_t bytes = 0;
+    unsigned frames = 0, late = 0;
+    unsigned strain = 0;        // windows in a row over ADAPT_LOAD_HIGH
+    unsigned calm = 0;          // windows in a row with room to step up
+    bool settling = false;
+    double ceiling = 0;         // bytes per second taken while overloaded, 0 if not known
+    unsigned quiet = 0;         // windows since then
+    double lastLoad = 0, lastRate = 0;
+
+  public:
+    /* Builds the ladder for `truecolor` output with `bits` per channel and
+     * starts at the top. A budget of 0 leaves only the write time.
+     */
+    void begin(bool truecolor, unsigned bits, double budgetBytes, clock::time_point now) {
+        ladder.clear();
+        ladder.push_back({100, 1, !truecolor, bits, 1});
+        if(truecolor) {
+            if(bits > 5)
+                ladder.push_back({100, 1, false, 5, .75});
+            ladder.push_back({100, 1, true, bits, .5});
+        }
+        static const struct { unsigned scale, rate; } steps[] = {
+            {80, 1}, {80, 2}, {60, 2}, {60, 3}, {45, 3}, {45, 4}, {35, 4},
+        };
+        const double colors = ladder.back().cost;
+        for(auto s : steps)
+            ladder.push_back({s.scale, s.rate, true, bits, colors * s.scale * s.scale / 10000 / s.rate});
+        level = 0;
+        budget = budgetBytes;
+        strain = calm = 0;
+        settling = false;
+        ceiling = 0;
+        restart(now);
+    }
+
+    bool active(void) const { return !ladder.empty(); }
+
+    // Starts a new window, for when time went by without frames, like a pause
+    void restart(clock::time_point now) {
+        windowStart = now;
+        blocked = 0;
+        bytes = 0;
+        frames = late = 0;
+    }
+
+    // Any thread may read the step; only the output thread changes it
+    unsigned step(void) const { return level.load(std::memory_order_relaxed); }
+    quality_t const& quality(unsigned s) const { return ladder[s]; }
+    unsigned steps(void) const { return ladder.size(); }
+    double load(void) const { return lastLoad; }
+    double throughput(void) const { return lastRate; }
+
+    /* Counts a frame of `size` bytes that took `seconds` to write, after
+     * `dropped` late ones. Returns true if that ended a window with a step
+     * up or down; with `rise` false it only steps down, for output whose
+     * quality is fixed, like a loop cache's.
+     */
+    bool wrote(size_t size, double seconds, unsigned dropped, bool rise, clock::time_point now) {
+        blocked += seconds;
+        bytes += size;
+        frames++;
+        late += dropped;
+        const double elapsed = std::chrono::duration<double>(now - windowStart).count();
+        if(elapsed < ADAPT_WINDOW_MS / 1000.0)
+            return false;
+        lastRate = bytes / elapsed;
+        lastLoad = blocked / elapsed * (frames + late) / frames;
+        if(budget > 0)
+            lastLoad = std::max(lastLoad, lastRate / budget);
+        restart(now);
+        if(settling) {
+            settling = false;
+            return false;
+        }
+
+        if(ceiling > 0 && ++quiet >= ADAPT_PROBE_WINDOWS)
+            ceiling = 0;
+        const unsigned l = level;
+        const double demand = lastLoad / ladder[l].cost; // the load the top step would have
+        const double room = std::max(lastLoad, ceiling > 0 ? lastRate / ceiling : 0) / ladder[l].cost;
+        if(lastLoad > ADAPT_LOAD_HIGH && l + 1 < ladder.size()) {
+            calm = 0;
+            if(++strain < ADAPT_DOWN_WINDOWS)
+                return false;
+            unsigned down = l + 1;
+            while(down + 1 < ladder.size() && demand * ladder[down].cost > ADAPT_LOAD_HIGH)
+                down++;
+            level = down;
+            ceiling = lastRate;
+            quiet = 0;
+        } else if(rise && l > 0 && room * ladder[l - 1].cost < ADAPT_LOAD_LOW) {
+            strain = 0;
+            if(++calm < ADAPT_UP_WINDOWS)
+                return false;
+            level = l - 1;
+        } else {
+            strain = calm = 0;
+            return false;
+        }
+        strain = calm = 0;
+        settling = true;
+        return true;
+    }
+};
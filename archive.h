@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Pre-rendered frame archive.
+ *
+ * Holds the encoder's output for every frame of a clip, so playing it back
+ * is only inflating and writing. Frames are grouped into chunks of
+ * ARCHIVE_CHUNK_FRAMES, each compressed on its own; the first frame of a
+ * chunk is always a full repaint, so playback can start at any chunk. No
+ * frame carries the cursor movement back to the top, which depends on what
+ * was drawn before it.
+ *
+ * Layout, little endian:
+ *     archive_header_t
+ *     compressed chunks
+ *     archive_chunk_t[chunks], archive_frame_t[frames]  (at header.indexOffset)
+ */
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "archives are written in host byte order");
+
+static const char ARCHIVE_MAGIC[8] = {'T', 'T', 'Y', 'D', 'A', 'R', 'C', '\n'};
+static constexpr uint32_t ARCHIVE_VERSION = 1;
+
+struct archive_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t frames;
+    uint32_t chunks;
+    uint8_t colorMode;
+    uint8_t halfBlocks;
+    uint16_t reserved;
+    uint64_t indexOffset;
+};
+
+struct archive_chunk_t {
+    uint64_t offset;    // of the compressed data in the file
+    uint32_t size;      // compressed
+    uint32_t rawSize;
+    uint32_t firstFrame;
+    uint32_t frameCount;
+};
+
+struct archive_frame_t {
+    double pts;         // seconds from the first frame
+    uint32_t offset;    // into the inflated chunk
+    uint32_t size;
+    uint16_t width, height;
+    uint32_t reserved;
+};
+
+// True if the file at `path` starts like an archive. Only regular files are read, so pipes lose nothing.
+static bool archive_probe(std::string const& path) {
+    struct stat st;
+    if(stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+    FILE* f = fopen(path.c_str(), "rb");
+    if(!f)
+        return false;
+    char magic[sizeof(ARCHIVE_MAGIC)];
+    bool match = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && !memcmp(magic, ARCHIVE_MAGIC, sizeof(magic));
+    fclose(f);
+    return match;
+}
+
+class ArchiveWriter {
+  private:
+    FILE* file = nullptr;
+    archive_header_t header;
+    std::vector<archive_chunk_t> chunks;
+    std::vector<archive_frame_t> frames;
+    std::string pending; // the chunk being filled
+    std::vector<unsigned char> compressed;
+    unsigned chunked = 0; // frames already in written chunks
+    double first = 0;
+
+    bool put(const void* p, size_t n) {
+        return fwrite(p, 1, n, file) == n;
+    }
+
+    bool flushChunk(void) {
+        if(frames.size() == chunked)
+            return true;
+        archive_chunk_t c;
+        c.offset = ftello(file);
+        c.rawSize = pending.size();
+        c.firstFrame = chunked;
+        c.frameCount = frames.size() - chunked;
+        chunked = frames.size();
+        uLongf size = compressBound(pending.size());
+        compressed.resize(size);
+        if(compress2(compressed.data(), &size, (const Bytef*)pending.data(), pending.size(), Z_BEST_COMPRESSION) != Z_OK)
+            return false;
+        c.size = size;
+        chunks.push_back(c);
+        pending.clear();
+        return put(compressed.data(), size);
+    }
+
+  public:
+    ~ArchiveWriter(void) {
+        if(file)
+            fclose(file);
+    }
+
+    // Returns false if the file couldn't be created
+    bool open(std::string const& path, uint8_t colorMode, bool halfBlocks) {
+        file = fopen(path.c_str(), "wb");
+        if(!file)
+            return false;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+        header.version = ARCHIVE_VERSION;
+        header.colorMode = colorMode;
+        header.halfBlocks = halfBlocks;
+        return put(&header, sizeof(header)); // filled in by close()
+    }
+
+    bool isOpen(void) const { return file != nullptr; }
+
+    // The next frame starts a chunk, so it has to be a full repaint
+    bool startsChunk(void) const {
+        return frames.size() % ARCHIVE_CHUNK_FRAMES == 0;
+    }
+
+    // Adds a frame shown at `pts` seconds. Returns false if writing failed.
+    bool frame(double pts, std::string const& data, unsigned width, unsigned height) {
+        if(frames.empty())
+            first = pts;
+        archive_frame_t f;
+        f.pts = std::max(pts - first, 0.0);
+        f.offset = pending.size();
+        f.size = data.size();
+        f.width = width;
+        f.height = height;
+        f.reserved = 0;
+        frames.push_back(f);
+        pending += data;
+        return frames.size() % ARCHIVE_CHUNK_FRAMES != 0 || flushChunk();
+    }
+
+    unsigned frameCount(void) const { return frames.size(); }
+
+    // Writes the index and header. Returns false if anything failed.
+    bool close(void) {
+        if(!file)
+            return true;
+        bool ok = flushChunk();
+        // the index is read in place, so it starts aligned
+        static const char zeros[8] = {0};
+        ok = ok && put(zeros, (8 - ftello(file) % 8) % 8);
+        header.frames = frames.size();
+        header.chunks = chunks.size();
+        header.indexOffset = ftello(file);
+        ok = ok && put(chunks.data(), chunks.size() * sizeof(archive_chunk_t))
+            && put(frames.data(), frames.size() * sizeof(archive_frame_t));
+        ok = ok && fseeko(file, 0, SEEK_SET) == 0 && put(&header, sizeof(header));
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+};
+
+/* Maps an archive and inflates its chunks. The index is checked on open,
+ * so chunk() and frame() never read outside the file.
+ */
+class ArchiveReader {
+  private:
+    const unsigned char* map = nullptr;
+    size_t length = 0;
+    const archive_header_t* header = nullptr;
+    const archive_chunk_t* chunkTable = nullptr;
+    const archive_frame_t* frameTable = nullptr;
+
+    // Finds the tables and checks that everything they point at is in the file
+    bool readIndex(void) {
+        if(memcmp(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) || header->version != ARCHIVE_VERSION)
+            return false;
+        const uint64_t index = header->indexOffset;
+        const uint64_t tables = (uint64_t)header->chunks * sizeof(archive_chunk_t)
+            + (uint64_t)header->frames * sizeof(archive_frame_t);
+        if(index % 8 || index < sizeof(archive_header_t) || index > length || tables > length - index)
+            return false;
+        chunkTable = (const archive_chunk_t*)(map + index);
+        frameTable = (const archive_frame_t*)(map + index + (uint64_t)header->chunks * sizeof(archive_chunk_t));
+        uint32_t next = 0;
+        for(uint32_t i = 0; i < header->chunks; ++i) {
+            const archive_chunk_t& c = chunkTable[i];
+            if(c.offset < sizeof(archive_header_t) || c.offset > header->indexOffset || c.size > header->indexOffset - c.offset)
+                return false;
+            if(c.firstFrame != next || c.frameCount > header->frames - next)
+                return false;
+            for(uint32_t f = c.firstFrame; f < c.firstFrame + c.frameCount; ++f)
+                if(frameTable[f].offset > c.rawSize || frameTable[f].size > c.rawSize - frameTable[f].offset)
+                    return false;
+            next += c.frameCount;
+        }
+        return next == header->frames;
+    }
+
+  public:
+    ~ArchiveReader(void) {
+        if(map)
+            munmap((void*)map, length);
+    }
+
+    // Returns false if the file can't be mapped or isn't a valid archive
+    bool open(std::string const& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(archive_header_t)) {
+            ::close(fd);
+            return false;
+        }
+        length = st.st_size;
+        void* p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(p == MAP_FAILED)
+            return false;
+        map = (const unsigned char*)p;
+        madvise(p, length, MADV_SEQUENTIAL);
+        header = (const archive_header_t*)map;
+        return readIndex();
+    }
+
+    unsigned frames(void) const { return header->frames; }
+    unsigned chunks(void) const { return header->chunks; }
+    uint8_t colorMode(void) const { return header->colorMode; }
+    bool halfBlocks(void) const { return header->halfBlocks; }
+    const archive_chunk_t& chunk(unsigned i) const { return chunkTable[i]; }
+    const archive_frame_t& frame(unsigned i) const { return frameTable[i]; }
+
+    // Inflates chunk `i` into `out`. Returns false if the data is corrupt.
+    bool inflate(unsigned i, std::vector<char>& out) const {
+        const archive_chunk_t& c = chunkTable[i];
+        out.resize(c.rawSize);
+        uLongf size = c.rawSize;
+        return uncompress((Bytef*)out.data(), &size, map + c.offset, c.size) == Z_OK && size == c.rawSize;
+    }
+};
@@ -0,0 +1,484 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+#include "colors.h"
+#include "conf.h"
+#include "quantize.h"
+#include "dither.h"
+#include "encoder.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+#include "libavutil/pixdesc.h"
+#include "libavformat/avformat.h"
+#include "libswscale/swscale.h"
+#include <stdio.h>
+}
+
+#include "yuv.h"
+#include "scaler.h"
+#include "boxscale.h"
+
+/* Stage benchmarks.
+ *
+ * Runs each stage of the pipeline (scaling, quantization, encoding) on its
+ * own, single threaded, over a short sequence of synthetic frames and
+ * optionally frames decoded from a file, at a few canvas sizes. Nothing is
+ * written to a terminal. Every stage reports time per cell, cells per second
+ * and, for the encoder, bytes per frame, as JSON or CSV.
+ */
+
+using clk = std::chrono::steady_clock;
+
+struct bench_config_t {
+    std::string filename;
+    std::vector<std::pair<unsigned, unsigned>> sizes{{80, 24}, {160, 48}, {320, 90}};
+    unsigned frames = 16;       // frames per source
+    double seconds = 0.2;       // minimum time spent on each case
+    bool csv = false;
+};
+
+struct result_t {
+    std::string stage, variant, isa, mode, source;
+    unsigned width, height;
+    unsigned iterations;
+    double nsPerCell;
+    double bytesPerFrame;
+};
+
+struct source_t {
+    std::string name;
+    std::vector<AVFrame*> frames;
+};
+
+static bench_config_t bench;
+static std::vector<result_t> results;
+static const quantize_isa_t quantize_isa = detect_quantize_isa();
+
+/* Calls fn(i) for i = 0, 1, ... until at least `bench.seconds` have passed
+ * and every frame has been seen once. Returns nanoseconds per call.
+ */
+static double measure(unsigned frames, unsigned& iterations, std::function<void(unsigned)> const& fn) {
+    fn(0); // warm up caches and lazily built state
+    const auto budget = std::chrono::duration<double>(bench.seconds);
+    auto start = clk::now();
+    iterations = 0;
+    do {
+        fn(iterations % frames);
+        iterations++;
+    } while(iterations < frames || clk::now() - start < budget);
+    return std::chrono::duration<double, std::nano>(clk::now() - start).count() / iterations;
+}
+
+static void record(std::string stage, std::string variant, std::string isa, std::string mode, source_t const& src,
+        unsigned width, unsigned height, unsigned iterations, double ns, double bytes = 0) {
+    results.push_back({stage, variant, isa, mode, src.name, width, height, iterations, ns / ((double)width * height), bytes});
+}
+
+/* A slow gradient with a bright square moving across it, so that consecutive
+ * frames share most of their cells the way real video does.
+ */
+static AVFrame* synthetic_frame(AVPixelFormat format, int width, int height, unsigned n) {
+    AVFrame* f = av_frame_alloc();
+    f->format = format;
+    f->width = width;
+    f->height = height;
+    if(av_frame_get_buffer(f, 32) < 0) {
+        av_frame_free(&f);
+        return nullptr;
+    }
+    const int size = height / 4, left = (n * 24) % (width - size), top = (n * 8) % (height - size);
+    auto inside = [&](int x, int y) {
+        return x >= left && x < left + size && y >= top && y < top + size;
+    };
+    for(int y = 0; y < height; ++y) {
+        for(int x = 0; x < width; ++x) {
+            uint8_t r = x * 255 / width, g = y * 255 / height, b = (x + y) * 127 / (width + height) + 64;
+            if(inside(x, y))
+                r = g = b = 235;
+            if(format == AV_PIX_FMT_RGB24) {
+                uint8_t* p = f->data[0] + y * f->linesize[0] + x * 3;
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+            } else {
+                // BT.601 limited range
+                f->data[0][y * f->linesize[0] + x] = 16 + (66 * r + 129 * g + 25 * b + 128) / 256;
+                if(!(x & 1) && !(y & 1)) {
+                    f->data[1][(y / 2) * f->linesize[1] + x / 2] = 128 + (-38 * r - 74 * g + 112 * b + 128) / 256;
+                    f->data[2][(y / 2) * f->linesize[2] + x / 2] = 128 + (112 * r - 94 * g - 18 * b + 128) / 256;
+                }
+            }
+        }
+    }
+    if(format != AV_PIX_FMT_RGB24) {
+        f->colorspace = AVCOL_SPC_SMPTE170M;
+        f->color_range = AVCOL_RANGE_MPEG;
+        f->chroma_location = AVCHROMA_LOC_LEFT;
+    }
+    return f;
+}
+
+// Decodes the first `count` video frames of a file
+static int read_frames(std::string const& filename, unsigned count, source_t& src) {
+    AVFormatContext* format = nullptr;
+    if(avformat_open_input(&format, filename.c_str(), NULL, NULL) != 0) {
+        std::cerr << "Error reading input from file `" << filename << "'" << std::endl;
+        return 1;
+    }
+    if(avformat_find_stream_info(format, NULL) < 0) {
+        std::cerr << "Error finding stream info" << std::endl;
+        avformat_close_input(&format);
+        return 1;
+    }
+    int index = -1;
+    for(unsigned i = 0; i < format->nb_streams; ++i) {
+        if(format->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            index = i;
+            break;
+        }
+    }
+    if(index < 0) {
+        std::cerr << "Could not read any video stream" << std::endl;
+        avformat_close_input(&format);
+        return 2;
+    }
+    AVCodecContext* context = avcodec_alloc_context3(nullptr);
+    avcodec_parameters_to_context(context, format->streams[index]->codecpar);
+    AVCodec* codec = avcodec_find_decoder(context->codec_id);
+    if(!codec || avcodec_open2(context, codec, NULL) < 0) {
+        std::cerr << "Unsupported codec" << std::endl;
+        avcodec_free_context(&context);
+        avformat_close_input(&format);
+        return 4;
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    AVFrame* frame = av_frame_alloc();
+    auto receive = [&] {
+        while(src.frames.size() < count && avcodec_receive_frame(context, frame) == 0)
+            src.frames.push_back(av_frame_clone(frame));
+    };
+    while(src.frames.size() < count && av_read_frame(format, &packet) >= 0) {
+        if(packet.stream_index == index && avcodec_send_packet(context, &packet) == 0)
+            receive();
+        av_packet_unref(&packet);
+    }
+    avcodec_send_packet(context, NULL);
+    receive();
+
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+    avformat_close_input(&format);
+    if(src.frames.empty()) {
+        std::cerr << "No frames decoded from `" << filename << "'" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// RGB24 copies of a scaled sequence, so later stages don't measure swscale
+struct scaled_t {
+    unsigned width = 0, height = 0;
+    std::vector<std::vector<uint8_t>> rgb;
+};
+
+static void copy_rgb(const AVFrame* f, std::vector<uint8_t>& out) {
+    out.resize((size_t)f->width * f->height * 3);
+    for(int y = 0; y < f->height; ++y)
+        memcpy(out.data() + (size_t)y * f->width * 3, f->data[0] + y * f->linesize[0], f->width * 3);
+}
+
+static void bench_scale(source_t const& src, unsigned width, unsigned height, scaled_t& scaled) {
+    const unsigned n = src.frames.size();
+    Scaler scaler{1};
+    unsigned it;
+    double ns = measure(n, it, [&](unsigned i) { scaler.scale(src.frames[i], width, height, AV_PIX_FMT_RGB24); });
+    record("scale", "bicubic-rgb24", "-", "-", src, width, height, it, ns);
+
+    if(yuv_source(src.frames[0]->format)) {
+        ns = measure(n, it, [&](unsigned i) { scaler.scale(src.frames[i], width, height, AV_PIX_FMT_YUV444P); });
+        record("scale", "bicubic-yuv444p", "-", "-", src, width, height, it, ns);
+    }
+
+    if(BoxScaler::supports(src.frames[0], width, height)) {
+        for(unsigned isa = ISA_SCALAR; isa <= quantize_isa; ++isa) {
+            // later ISAs may reuse an earlier kernel
+            if(isa != ISA_SCALAR && select_box_add_row((quantize_isa_t)isa) == select_box_add_row((quantize_isa_t)(isa - 1)))
+                continue;
+            BoxScaler box{(quantize_isa_t)isa};
+            std::vector<uint8_t> rgb(width * 3), yr(width), ur(width), vr(width);
+            ns = measure(n, it, [&](unsigned i) {
+                box.prepare(src.frames[i], width, height);
+                for(unsigned y = 0; y < height; ++y)
+                    box.row(src.frames[i], y, rgb.data(), yr.data(), ur.data(), vr.data());
+            });
+            record("scale", "box", quantize_isa_name((quantize_isa_t)isa), "-", src, width, height, it, ns);
+        }
+    }
+
+    scaled.width = width;
+    scaled.height = height;
+    scaled.rgb.resize(n);
+    for(unsigned i = 0; i < n; ++i)
+        copy_rgb(scaler.scale(src.frames[i], width, height, AV_PIX_FMT_RGB24), scaled.rgb[i]);
+}
+
+// Quantizes a whole scaled sequence with one row kernel
+static void quantize_all(scaled_t const& s, quantize_row_fn fn, std::vector<std::vector<uint32_t>>& grids) {
+    grids.resize(s.rgb.size());
+    for(size_t i = 0; i < s.rgb.size(); ++i) {
+        grids[i].resize((size_t)s.width * s.height);
+        for(unsigned y = 0; y < s.height; ++y)
+            fn(s.rgb[i].data() + (size_t)y * s.width * 3, grids[i].data() + (size_t)y * s.width, s.width, 0);
+    }
+}
+
+static void bench_quantize(source_t const& src, scaled_t const& s) {
+    const unsigned n = s.rgb.size(), width = s.width, height = s.height;
+    std::vector<uint32_t> cells((size_t)width * height);
+    unsigned it;
+    auto rows = [&](quantize_row_fn fn) {
+        return measure(n, it, [&](unsigned i) {
+            for(unsigned y = 0; y < height; ++y)
+                fn(s.rgb[i].data() + (size_t)y * width * 3, cells.data() + (size_t)y * width, width, 0);
+        });
+    };
+
+    // select_quantize_row() falls back to the scalar scan without a table
+    color_lut.build(0);
+    double ns = rows(select_quantize_row(true, ISA_SCALAR, 0));
+    record("quantize", "accurate-scan", "scalar", "256", src, width, height, it, ns);
+    color_lut.build(COLOR_LUT_BITS);
+    for(unsigned isa = ISA_SCALAR; isa <= quantize_isa; ++isa) {
+        const char* name = quantize_isa_name((quantize_isa_t)isa);
+        ns = rows(select_quantize_row(false, (quantize_isa_t)isa, 0));
+        record("quantize", "fast", name, "256", src, width, height, it, ns);
+        ns = rows(select_quantize_row(true, (quantize_isa_t)isa, 0));
+        record("quantize", "accurate-lut", name, "256", src, width, height, it, ns);
+    }
+
+    build_truecolor_levels(TRUECOLOR_BITS, 0);
+    ns = rows(quantize_row_truecolor);
+    record("quantize", "truecolor", "scalar", "true", src, width, height, it, ns);
+
+    quantize_row_fn best = select_quantize_row(true, quantize_isa, 0);
+    build_ordered_dither(DITHER_SPREAD);
+    std::vector<uint8_t> dithered(width * 3);
+    ns = measure(n, it, [&](unsigned i) {
+        for(unsigned y = 0; y < height; ++y) {
+            dither_row_ordered(s.rgb[i].data() + (size_t)y * width * 3, dithered.data(), width, y);
+            best(dithered.data(), cells.data() + (size_t)y * width, width, 0);
+        }
+    });
+    record("quantize", "ordered", quantize_isa_name(quantize_isa), "256", src, width, height, it, ns);
+
+    ErrorDiffusion diffusion;
+    diffusion.use(true, 0);
+    ns = measure(n, it, [&](unsigned i) {
+        diffusion.begin(width);
+        for(unsigned y = 0; y < height; ++y)
+            diffusion.row(s.rgb[i].data() + (size_t)y * width * 3, cells.data() + (size_t)y * width, width);
+    });
+    record("quantize", "fs", "scalar", "256", src, width, height, it, ns);
+}
+
+static void bench_quantize_yuv(source_t const& src, unsigned width, unsigned height) {
+    if(!yuv_source(src.frames[0]->format))
+        return;
+    const unsigned n = src.frames.size();
+    Scaler scaler{n};
+    std::vector<AVFrame*> planes(n);
+    for(unsigned i = 0; i < n; ++i)
+        planes[i] = scaler.scale(src.frames[i], width, height, AV_PIX_FMT_YUV444P);
+    YuvLUT lut;
+    lut.build(YUV_LUT_BITS, yuv_matrix(src.frames[0]), yuv_full_range(src.frames[0]), true, 0);
+
+    std::vector<uint32_t> cells((size_t)width * height);
+    for(unsigned i = ISA_SCALAR; i <= quantize_isa; ++i) {
+        quantize_isa_t isa = (quantize_isa_t)i;
+        quantize_yuv_row_fn fn = select_quantize_yuv_row(isa);
+        if(isa != ISA_SCALAR && fn == select_quantize_yuv_row((quantize_isa_t)(i - 1)))
+            continue;
+        unsigned it;
+        double ns = measure(n, it, [&](unsigned i) {
+            const AVFrame* f = planes[i];
+            for(unsigned y = 0; y < height; ++y)
+                fn(f->data[0] + y * f->linesize[0], f->data[1] + y * f->linesize[1], f->data[2] + y * f->linesize[2],
+                        cells.data() + (size_t)y * width, width, lut);
+        });
+        record("quantize", "yuv-lut", quantize_isa_name(isa), "256", src, width, height, it, ns);
+    }
+}
+
+/* Encodes every grid of a sequence in turn. Delta runs start from the last
+ * grid, like looping playback would.
+ */
+static void bench_encode(source_t const& src, std::vector<std::vector<uint32_t>> const& grids, unsigned width,
+        unsigned height, color_mode_t mode, bool half) {
+    const unsigned n = grids.size();
+    const std::string name = std::string(mode == COLOR_TRUE ? "true" : "256") + (half ? "/hb" : "");
+    for(bool delta : {false, true}) {
+        FrameEncoder encoder;
+        encoder.colorMode = mode;
+        encoder.halfBlocks = half;
+        encoder.delta = delta;
+        size_t bytes = 0;
+        unsigned it;
+        double ns = measure(n, it, [&](unsigned i) {
+            encoder.begin(width, height);
+            encoder.frame(grids[i].data(), width, height);
+            bytes += encoder.size();
+        });
+        // the warm up call is in `bytes` too
+        record("encode", delta ? "delta" : "full", "-", name, src, width, height, it, ns, (double)bytes / (it + 1));
+    }
+}
+
+static void bench_source(source_t const& src) {
+    for(auto const& size : bench.sizes) {
+        const unsigned width = size.first, height = size.second;
+        scaled_t scaled, tall;
+        bench_scale(src, width, height, scaled);
+        bench_quantize(src, scaled);
+        bench_quantize_yuv(src, width, height);
+
+        std::vector<std::vector<uint32_t>> grids;
+        quantize_all(scaled, select_quantize_row(true, quantize_isa, 0), grids);
+        bench_encode(src, grids, width, height, COLOR_256, false);
+        quantize_all(scaled, quantize_row_truecolor, grids);
+        bench_encode(src, grids, width, height, COLOR_TRUE, false);
+
+        // half blocks draw two pixel rows per cell
+        Scaler scaler{1};
+        tall.width = width;
+        tall.height = height * 2;
+        tall.rgb.resize(src.frames.size());
+        for(size_t i = 0; i < src.frames.size(); ++i)
+            copy_rgb(scaler.scale(src.frames[i], width, height * 2, AV_PIX_FMT_RGB24), tall.rgb[i]);
+        quantize_all(tall, select_quantize_row(true, quantize_isa, 0), grids);
+        bench_encode(src, grids, width, height, COLOR_256, true);
+        quantize_all(tall, quantize_row_truecolor, grids);
+        bench_encode(src, grids, width, height, COLOR_TRUE, true);
+    }
+}
+
+static void print_json(std::ostream& out) {
+    out << "{\n  \"isa\": \"" << quantize_isa_name(quantize_isa) << "\",\n  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        auto const& r = results[i];
+        out << "    {\"stage\": \"" << r.stage << "\", \"variant\": \"" << r.variant << "\", \"isa\": \"" << r.isa
+            << "\", \"mode\": \"" << r.mode << "\", \"source\": \"" << r.source << "\", \"width\": " << r.width
+            << ", \"height\": " << r.height << ", \"iterations\": " << r.iterations
+            << ", \"ns_per_cell\": " << r.nsPerCell << ", \"cells_per_s\": " << 1e9 / r.nsPerCell
+            << ", \"bytes_per_frame\": " << r.bytesPerFrame << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+static void print_csv(std::ostream& out) {
+    out << "stage,variant,isa,mode,source,width,height,iterations,ns_per_cell,cells_per_s,bytes_per_frame\n";
+    for(auto const& r : results)
+        out << r.stage << ',' << r.variant << ',' << r.isa << ',' << r.mode << ',' << r.source << ','
+            << r.width << ',' << r.height << ',' << r.iterations << ',' << r.nsPerCell << ','
+            << 1e9 / r.nsPerCell << ',' << r.bytesPerFrame << '\n';
+}
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [options]\n"
+        << "    -i file:\n"
+        << "        Also run on the first frames decoded from a file\n"
+        << "    -n frames:\n"
+        << "        Frames per source (default 16)\n"
+        << "    -s WxH[,WxH...]:\n"
+        << "        Canvas sizes in cells (default 80x24,160x48,320x90)\n"
+        << "    -t seconds:\n"
+        << "        Minimum time spent on each case (default 0.2)\n"
+        << "    -csv:\n"
+        << "        Print CSV instead of JSON\n";
+}
+
+static bool parse_sizes(std::string arg) {
+    bench.sizes.clear();
+    size_t pos = 0;
+    while(pos <= arg.size()) {
+        size_t end = arg.find(',', pos);
+        if(end == std::string::npos)
+            end = arg.size();
+        unsigned w, h;
+        if(sscanf(arg.substr(pos, end - pos).c_str(), "%ux%u", &w, &h) != 2 || !w || !h)
+            return false;
+        bench.sizes.push_back({w, h});
+        pos = end + 1;
+    }
+    return !bench.sizes.empty();
+}
+
+int main(int argc, char** argv) {
+    av_log_set_level(AV_LOG_ERROR);
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool more = i + 1 < argc;
+        if(arg == "-i" && more) {
+            bench.filename = argv[++i];
+        } else if(arg == "-n" && more) {
+            bench.frames = std::max(1, atoi(argv[++i]));
+        } else if(arg == "-s" && more) {
+            if(!parse_sizes(argv[++i])) {
+                std::cerr << "Bad canvas sizes `" << argv[i] << "'" << std::endl;
+                return 1;
+            }
+        } else if(arg == "-t" && more) {
+            bench.seconds = atof(argv[++i]);
+        } else if(arg == "-csv") {
+            bench.csv = true;
+        } else {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    std::vector<source_t> sources(2);
+    sources[0].name = "synthetic-yuv420p";
+    sources[1].name = "synthetic-rgb24";
+    for(unsigned i = 0; i < bench.frames; ++i) {
+        sources[0].frames.push_back(synthetic_frame(AV_PIX_FMT_YUV420P, 1280, 720, i));
+        sources[1].frames.push_back(synthetic_frame(AV_PIX_FMT_RGB24, 1280, 720, i));
+        if(!sources[0].frames.back() || !sources[1].frames.back()) {
+            std::cerr << "Error allocating frames" << std::endl;
+            return 1;
+        }
+    }
+    if(!bench.filename.empty()) {
+        sources.emplace_back();
+        sources.back().name = "recorded";
+        if(read_frames(bench.filename, bench.frames, sources.back()))
+            return 1;
+    }
+
+    for(auto& src : sources) {
+        const AVFrame* f = src.frames[0];
+        std::cerr << "Running " << src.name << " (" << f->width << "x" << f->height << " "
+            << av_get_pix_fmt_name((AVPixelFormat)f->format);
+        if(yuv_source(f->format))
+            std::cerr << ", " << yuv_matrix_name(yuv_matrix(f));
+        std::cerr << ")" << std::endl;
+        bench_source(src);
+        for(auto& f : src.frames)
+            av_frame_free(&f);
+    }
+
+    if(bench.csv)
+        print_csv(std::cout);
+    else
+        print_json(std::cout);
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include <cstdint>
+#include <vector>
+
+/* Area averaging (box) downscaler.
+ *
+ * Every output pixel is the average of the source pixels it covers. Sources
+ * are read straight from the decoded frame, a row of output pixels at a
+ * time: the source rows under it are summed into a row of 16-bit counters
+ * (the vector part, one widening add per source byte), then each output
+ * pixel adds up its columns and divides. Only a row of averages ever exists,
+ * so the quantizer takes them straight to cells without a scaled frame.
+ *
+ * Packed RGB24 and 8-bit planar YUV sources are supported. For YUV, chroma
+ * is averaged over the chroma samples under each output pixel; at the
+ * ratios this is meant for, chroma siting is well below one output pixel.
+ */
+
+enum scale_mode_t { SCALE_BICUBIC, SCALE_BOX };
+
+typedef void (*box_add_row_fn)(const uint8_t* src, uint16_t* acc, unsigned n);
+
+static void box_add_row_scalar(const uint8_t* src, uint16_t* acc, unsigned n) {
+    for(unsigned i = 0; i < n; ++i)
+        acc[i] += src[i];
+}
+
+#ifdef QUANTIZE_X86
+__attribute__((target("sse4.1")))
+static void box_add_row_sse41(const uint8_t* src, uint16_t* acc, unsigned n) {
+    unsigned i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i* a = (__m128i*)(acc + i);
+        _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_cvtepu8_epi16(v)));
+        _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_cvtepu8_epi16(_mm_srli_si128(v, 8))));
+    }
+    box_add_row_scalar(src + i, acc + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void box_add_row_avx2(const uint8_t* src, uint16_t* acc, unsigned n) {
+    unsigned i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m256i* a = (__m256i*)(acc + i);
+        __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i)));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i + 16)));
+        _mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), lo));
+        _mm256_storeu_si256(a + 1, _mm256_add_epi16(_mm256_loadu_si256(a + 1), hi));
+    }
+    box_add_row_scalar(src + i, acc + i, n - i);
+}
+#endif
+
+static box_add_row_fn select_box_add_row(quantize_isa_t isa) {
+#ifdef QUANTIZE_X86
+    if(isa == ISA_AVX2 || isa == ISA_AVX512)
+        return box_add_row_avx2;
+    if(isa == ISA_SSE41)
+        return box_add_row_sse41;
+#else
+    (void)isa;
+#endif
+    return box_add_row_scalar;
+}
+
+class BoxScaler {
+  private:
+    struct span_t {
+        unsigned begin, end;
+    };
+    struct key_t {
+        int srcWidth = 0, srcHeight = 0, srcFormat = AV_PIX_FMT_NONE;
+        unsigned width = 0, height = 0;
+
+        bool operator==(key_t const& o) const {
+            return srcWidth == o.srcWidth && srcHeight == o.srcHeight && srcFormat == o.srcFormat
+                && width == o.width && height == o.height;
+        }
+    } key;
+
+    std::vector<span_t> cols, rows, chromaCols, chromaRows;
+    box_add_row_fn addRow;
+
+    // Output pixel i covers source [i * from / to, (i + 1) * from / to), at least one wide
+    static void spans(std::vector<span_t>& s, unsigned from, unsigned to, unsigned sub) {
+        s.resize(to);
+        unsigned size = (from + (1u << sub) - 1) >> sub;
+        for(unsigned i = 0; i < to; ++i) {
+            unsigned b = (unsigned)((uint64_t)i * from / to) >> sub;
+            unsigned e = (unsigned)(((uint64_t)(i + 1) * from / to + (1u << sub) - 1) >> sub);
+            s[i].begin = std::min(b, size - 1);
+            s[i].end = std::max(std::min(e, size), s[i].begin + 1);
+        }
+    }
+
+    // Averages one row of `channels` interleaved channels
+    void average(const uint8_t* base, int stride, span_t rs, std::vector<span_t> const& cs, unsigned channels,
+            uint8_t* out) const {
+        thread_local std::vector<uint16_t> acc16;
+        thread_local std::vector<uint32_t> acc32;
+        const unsigned n = cs.back().end * channels;
+        acc16.assign(n, 0);
+        acc32.assign(n, 0);
+        unsigned pending = 0;
+        auto flush = [&] {
+            for(unsigned i = 0; i < n; ++i)
+                acc32[i] += acc16[i];
+            std::fill(acc16.begin(), acc16.end(), 0);
+            pending = 0;
+        };
+        for(unsigned r = rs.begin; r < rs.end; ++r) {
+            addRow(base + (size_t)r * stride, acc16.data(), n);
+            if(++pending == 257) // 257 * 255 is as far as 16 bits go
+                flush();
+        }
+        flush();
+
+        const unsigned rowsCovered = rs.end - rs.begin;
+        for(size_t x = 0; x < cs.size(); ++x) {
+            const unsigned area = (cs[x].end - cs[x].begin) * rowsCovered;
+            for(unsigned c = 0; c < channels; ++c) {
+                uint32_t sum = 0;
+                for(unsigned i = cs[x].begin; i < cs[x].end; ++i)
+                    sum += acc32[i * channels + c];
+                out[x * channels + c] = (sum + area / 2) / area;
+            }
+        }
+    }
+
+  public:
+    BoxScaler(quantize_isa_t isa) : addRow(select_box_add_row(isa)) { }
+
+    // Box scaling only ever shrinks
+    static bool supports(const AVFrame* frame, unsigned width, unsigned height) {
+        if(width > (unsigned)frame->width || height > (unsigned)frame->height)
+            return false;
+        return frame->format == AV_PIX_FMT_RGB24 || yuv_source(frame->format);
+    }
+
+    // Returns true if the spans had to be worked out again
+    bool prepare(const AVFrame* frame, unsigned width, unsigned height) {
+        key_t k;
+        k.srcWidth = frame->width;
+        k.srcHeight = frame->height;
+        k.srcFormat = frame->format;
+        k.width = width;
+        k.height = height;
+        if(k == key)
+            return false;
+        key = k;
+        spans(cols, frame->width, width, 0);
+        spans(rows, frame->height, height, 0);
+        if(yuv_source(frame->format)) {
+            const AVPixFmtDescriptor* d = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+            spans(chromaCols, frame->width, width, d->log2_chroma_w);
+            spans(chromaRows, frame->height, height, d->log2_chroma_h);
+        }
+        return true;
+    }
+
+    /* Averages output row y. RGB24 sources fill `rgb`; YUV sources fill the
+     * `y`, `u` and `v` rows.
+     */
+    void row(const AVFrame* frame, unsigned y, uint8_t* rgb, uint8_t* yr, uint8_t* ur, uint8_t* vr) const {
+        if(frame->format == AV_PIX_FMT_RGB24) {
+            average(frame->data[0], frame->linesize[0], rows[y], cols, 3, rgb);
+            return;
+        }
+        average(frame->data[0], frame->linesize[0], rows[y], cols, 1, yr);
+        average(frame->data[1], frame->linesize[1], chromaRows[y], chromaCols, 1, ur);
+        average(frame->data[2], frame->linesize[2], chromaRows[y], chromaCols, 1, vr);
+    }
+};
@@ -1,11 +1,111 @@
 #define LOG_FILENAME "out.log"
 
-/* Number of nanoseconds to spinlock (instead of sleeping) between frames.
- * Higher is more work for the CPU, lower is less accurate.
+/* Number of log lines kept in memory to print on an error, so that a loop
+ * left running for days doesn't grow without bound.
  */
-#define SPINLOCK_NS 1E6
+#define LOG_KEEP_LINES 256
+
+/* Number of nanoseconds a frame may be behind its presentation time before it
+ * is dropped instead of drawn (as long as a newer frame is ready).
+ */
+#define LATE_THRESHOLD_NS 2.5E7
+
+/* Number of frames each pipeline stage can run ahead of the next one.
+ */
+#define PIPELINE_DEPTH 4
+
+/* Rows per band when quantizing and encoding a frame. Bands are the unit of
+ * work for -j, and output is the same for any number of threads.
+ */
+#define RENDER_BAND_ROWS 8
 
 // width / height
 #define PIXEL_ASPECT_RATIO .5
 
 #define COLOR_BIAS 0
+
+/* Default resolution, in bits per channel, of the RGB -> palette lookup
+ * table used for accurate colors. 0 disables the table.
+ */
+#define COLOR_LUT_BITS 6
+
+/* Resolution, in bits per channel, of the YUV -> palette table used to
+ * quantize YUV video without converting it to RGB first.
+ */
+#define YUV_LUT_BITS 7
+
+/* Peak to peak size of the ordered dithering offsets, about the distance
+ * between neighbouring levels of the palette's color cube.
+ */
+#define DITHER_SPREAD 40
+
+/* Default bits per channel kept in truecolor mode. Fewer bits merge more
+ * neighbouring cells into the same color escape.
+ */
+#define TRUECOLOR_BITS 8
+
+/* With -c auto on a truecolor terminal, 256 colors are used instead when
+ * the first frame takes more than this many times the bytes in truecolor,
+ * as long as quantizing it to the palette takes less than AUTO_COLOR_CPU_SHARE
+ * of a frame's time.
+ */
+#define AUTO_COLOR_BYTES_RATIO 2.5
+#define AUTO_COLOR_CPU_SHARE .5
+
+/* Events kept per thread by -trace, oldest overwritten first. Must be a power
+ * of two.
+ */
+#define TRACE_EVENTS 65536
+
+/* Frames per independently compressed chunk of a -compile archive. Each
+ * chunk starts with a full repaint, so smaller chunks seek finer but
+ * compress worse.
+ */
+#define ARCHIVE_CHUNK_FRAMES 64
+
+/* Seconds skipped by the left/right and down/up keys.
+ */
+#define SEEK_SECONDS 10.0
+#define SEEK_LONG_SECONDS 60.0
+
+/* Memory for the encoded frames of a looping clip, in MiB (-cache), so
+ * passes after the first don't decode. 0 turns it off.
+ */
+#define LOOP_CACHE_MB 256
+
+/* Frames queued for a -serve viewer before it is treated as too slow and
+ * its queue emptied.
+ */
+#define SERVE_QUEUE_FRAMES 4
+
+/* Custom input (see input.h): regular files at least READAHEAD_MIN_BYTES
+ * long are read with READAHEAD_BYTES asked for ahead of the demuxer.
+ * INPUT_BUFFER_BYTES is the demuxer's buffer for those files and pipes.
+ */
+#define READAHEAD_MIN_BYTES (1 << 20)
+#define READAHEAD_BYTES (8 << 20)
+#define INPUT_BUFFER_BYTES (1 << 16)
+
+/* How much of a pipe is probed for streams before playing starts; less
+ * than libavformat's default, so live sources start sooner.
+ */
+#define PIPE_PROBE_BYTES (1 << 19)
+
+/* Ticks per second of a -mosaic display, unless -f is given. Each tick
+ * writes one update covering every tile with a new frame.
+ */
+#define MOSAIC_FPS 30
+
+/* Adaptive quality (see adapt.h). The load is measured over windows of
+ * ADAPT_WINDOW_MS; quality steps down after ADAPT_DOWN_WINDOWS windows in
+ * a row over ADAPT_LOAD_HIGH, and back up after ADAPT_UP_WINDOWS windows in
+ * a row in which the step up would have kept it under ADAPT_LOAD_LOW. The
+ * rate the terminal managed when overloaded is its limit for
+ * ADAPT_PROBE_WINDOWS windows.
+ */
+#define ADAPT_WINDOW_MS 1000
+#define ADAPT_DOWN_WINDOWS 2
+#define ADAPT_LOAD_HIGH .8
+#define ADAPT_LOAD_LOW .4
+#define ADAPT_UP_WINDOWS 5
+#define ADAPT_PROBE_WINDOWS 30
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Transport controls.
+ *
+ * KeyReader turns what is typed on a non-canonical terminal into commands:
+ *
+ *     space, p      pause / resume
+ *     right, l      forward SEEK_SECONDS     left, h    back SEEK_SECONDS
+ *     up, k         forward SEEK_LONG_SECONDS down, j   back SEEK_LONG_SECONDS
+ *     0 - 9         jump to 0% - 90%
+ *     q             quit
+ *
+ * Arrows come as CSI or, in application cursor mode, SS3 sequences; any
+ * other escape sequence, like a modified arrow or a function key, is
+ * skipped whole.
+ *
+ * KeyframeIndex remembers where the keyframes are in the parts of the file
+ * demuxed so far, so seeks into those parts land exactly on the keyframe
+ * before the target.
+ */
+
+enum control_t { CONTROL_PAUSE, CONTROL_SEEK_BY, CONTROL_SEEK_TO, CONTROL_QUIT };
+
+struct command_t {
+    control_t control;
+    double amount; // seconds for CONTROL_SEEK_BY, a fraction of the length for CONTROL_SEEK_TO
+};
+
+class KeyReader {
+  private:
+    static constexpr size_t MAX_ESCAPE_BYTES = 32;
+    std::string pending; // an escape sequence cut short
+
+    template<typename F>
+    static void arrow(char key, F emit) {
+        switch(key) {
+            case 'A': emit(command_t{CONTROL_SEEK_BY, SEEK_LONG_SECONDS}); break;
+            case 'B': emit(command_t{CONTROL_SEEK_BY, -SEEK_LONG_SECONDS}); break;
+            case 'C': emit(command_t{CONTROL_SEEK_BY, SEEK_SECONDS}); break;
+            case 'D': emit(command_t{CONTROL_SEEK_BY, -SEEK_SECONDS}); break;
+        }
+    }
+
+  public:
+    // Calls emit(command_t) for every complete key in `n` bytes of input
+    template<typename F>
+    void feed(const char* p, size_t n, F emit) {
+        pending.append(p, n);
+        size_t i = 0;
+        while(i < pending.size()) {
+            char c = pending[i];
+            if(c == '\x1B') {
+                if(i + 2 >= pending.size())
+                    break; // wait for the rest
+                if(pending[i + 1] == '[') {
+                    // CSI: parameter and intermediate bytes up to a final byte
+                    size_t end = i + 2;
+                    while(end < pending.size() && pending[end] >= 0x20 && pending[end] <= 0x3F)
+                        ++end;
+                    if(end == pending.size()) {
+                        if(end - i > MAX_ESCAPE_BYTES)
+                            i = end; // not a key anyone pressed
+                        break;
+                    }
+                    if(pending[end] < 0x40 || pending[end] > 0x7E) {
+                        i = end; // broken off; the byte is read on its own
+                        continue;
+                    }
+                    // only plain arrows; modified ones and function keys carry parameters
+                    if(end == i + 2)
+                        arrow(pending[end], emit);
+                    i = end + 1;
+                } else if(pending[i + 1] == 'O') {
+                    arrow(pending[i + 2], emit); // SS3, from application cursor mode
+                    i += 3;
+                } else {
+                    i += 1;
+                }
+                continue;
+            }
+            switch(c) {
+                case ' ': case 'p': emit(command_t{CONTROL_PAUSE, 0}); break;
+                case 'l': emit(command_t{CONTROL_SEEK_BY, SEEK_SECONDS}); break;
+                case 'h': emit(command_t{CONTROL_SEEK_BY, -SEEK_SECONDS}); break;
+                case 'k': emit(command_t{CONTROL_SEEK_BY, SEEK_LONG_SECONDS}); break;
+                case 'j': emit(command_t{CONTROL_SEEK_BY, -SEEK_LONG_SECONDS}); break;
+                case 'q': emit(command_t{CONTROL_QUIT, 0}); break;
+                default:
+                    if(c >= '0' && c <= '9')
+                        emit(command_t{CONTROL_SEEK_TO, (c - '0') / 10.0});
+            }
+            ++i;
+        }
+        pending.erase(0, i);
+    }
+};
+
+/* Keyframe timestamps and byte positions, in stream time base, along with
+ * the stretches of the stream that have been demuxed without a gap. Only
+ * the demux thread uses it.
+ */
+class KeyframeIndex {
+  public:
+    struct entry_t {
+        int64_t ts;
+        int64_t pos; // -1 if unknown
+    };
+
+  private:
+    std::vector<entry_t> keys;                       // sorted by ts
+    std::vector<std::pair<int64_t, int64_t>> spans;  // demuxed stretches, first to last ts
+    bool open = false;
+
+  public:
+    // Notes a demuxed packet
+    void packet(int64_t ts, int64_t pos, bool key) {
+        if(!open) {
+            spans.push_back({ts, ts});
+            open = true;
+        }
+        auto& s = spans.back();
+        s.first = std::min(s.first, ts);
+        s.second = std::max(s.second, ts);
+        if(!key)
+            return;
+        auto it = std::lower_bound(keys.begin(), keys.end(), ts, [](entry_t const& e, int64_t t) { return e.ts < t; });
+        if(it == keys.end() || it->ts != ts)
+            keys.insert(it, {ts, pos});
+    }
+
+    // The next packet comes from somewhere else in the stream
+    void seeked(void) {
+        open = false;
+    }
+
+    // The last keyframe at or before `ts`, if the stretch up to `ts` has been demuxed
+    const entry_t* before(int64_t ts) const {
+        auto it = std::upper_bound(keys.begin(), keys.end(), ts, [](int64_t t, entry_t const& e) { return t < e.ts; });
+        if(it == keys.begin())
+            return nullptr;
+        --it;
+        for(auto const& s : spans)
+            if(s.first <= it->ts && ts <= s.second)
+                return &*it;
+        return nullptr;
+    }
+
+    size_t size(void) const { return keys.size(); }
+};
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/* Dithering for palette output.
+ *
+ * Ordered dithering nudges each pixel by a fixed offset from an 8x8 Bayer
+ * matrix before the row kernel sees it. The offset only depends on the
+ * pixel's position, so unchanged pixels stay unchanged from frame to frame
+ * and rows stay independent of each other.
+ *
+ * Floyd-Steinberg carries each pixel's quantization error over to its
+ * neighbours. Rows depend on the row above, so a frame is diffused serially.
+ */
+
+enum dither_t { DITHER_NONE, DITHER_ORDERED, DITHER_FS };
+
+static const uint8_t bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/* Offsets are laid out per byte of an RGB24 row and repeat every 48 bytes
+ * (16 pixels), a multiple of both the 3 byte pixel and the 16 byte vector.
+ * They are split into a part to add and a part to subtract so that
+ * saturating byte arithmetic does the clamping.
+ */
+static uint8_t dither_add[8][48 + 16];
+static uint8_t dither_sub[8][48 + 16];
+
+static void build_ordered_dither(unsigned spread) {
+    for(unsigned y = 0; y < 8; ++y) {
+        for(unsigned i = 0; i < 48 + 16; ++i) {
+            int off = ((2 * bayer8[y][(i % 48) / 3 % 8] + 1 - 64) * (int)spread) / 128;
+            dither_add[y][i] = off > 0 ? off : 0;
+            dither_sub[y][i] = off < 0 ? -off : 0;
+        }
+    }
+}
+
+static void dither_row_ordered(const uint8_t* rgb, uint8_t* out, unsigned width, unsigned y) {
+    const uint8_t* add = dither_add[y & 7];
+    const uint8_t* sub = dither_sub[y & 7];
+    const unsigned n = width * 3;
+    unsigned i = 0;
+#ifdef QUANTIZE_X86
+    for(; i + 16 <= n; i += 16) {
+        unsigned o = i % 48;
+        __m128i v = _mm_loadu_si128((const __m128i*)(rgb + i));
+        v = _mm_adds_epu8(v, _mm_loadu_si128((const __m128i*)(add + o)));
+        v = _mm_subs_epu8(v, _mm_loadu_si128((const __m128i*)(sub + o)));
+        _mm_storeu_si128((__m128i*)(out + i), v);
+    }
+#endif
+    for(; i < n; ++i) {
+        int v = rgb[i] + add[i % 48] - sub[i % 48];
+        out[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+}
+
+/* Floyd-Steinberg state for one frame. Errors are kept in sixteenths, for
+ * the current and the next row, with a pixel of slack on either side.
+ */
+class ErrorDiffusion {
+  private:
+    std::vector<int> rows[2];
+    unsigned current = 0;
+    uint8_t pad = 0;
+    void (ErrorDiffusion::*kernel)(const uint8_t*, uint32_t*, unsigned) = &ErrorDiffusion::diffuse<quantize_search, false>;
+
+    static int clamp(int v) {
+        return v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+    // Sixteenths to a whole value, rounding halves away from zero so negative errors aren't cut short
+    static int sixteenths(int e) {
+        return (e >= 0 ? e + 8 : e - 8) / 16;
+    }
+
+    template<quantize_pixel_fn Match, bool Padded>
+    void diffuse(const uint8_t* rgb, uint32_t* out, unsigned width) {
+        int* cur = rows[current].data() + 3;
+        int* next = rows[current ^ 1].data() + 3;
+        std::fill(rows[current ^ 1].begin(), rows[current ^ 1].end(), 0);
+
+        for(int x = 0; x < (int)width; ++x, rgb += 3) {
+            int v[3];
+            for(int c = 0; c < 3; ++c) {
+                int p = Padded ? (rgb[c] >= pad ? rgb[c] - pad : 0) : rgb[c];
+                v[c] = clamp(p + sixteenths(cur[3 * x + c]));
+            }
+            uint32_t idx = Match(v[0], v[1], v[2], 0);
+            uint32_t q = colors[idx - 16];
+            int err[3] = {
+                v[0] - (int)((q >> 16) & 0xFF),
+                v[1] - (int)((q >> 8) & 0xFF),
+                v[2] - (int)(q & 0xFF),
+            };
+            for(int c = 0; c < 3; ++c) {
+                cur[3 * (x + 1) + c] += err[c] * 7;
+                next[3 * x - 3 + c] += err[c] * 3;
+                next[3 * x + c] += err[c] * 5;
+                next[3 * x + 3 + c] += err[c];
+            }
+            out[x] = idx;
+        }
+        current ^= 1;
+    }
+
+  public:
+    /* Picks the matching the row kernels use for `accurate`, once the color
+     * table is built. -fc padding is applied before the error is measured,
+     * so it is not dithered away.
+     */
+    void use(bool accurate, uint8_t padding) {
+        pad = accurate ? 0 : padding;
+        if(accurate)
+            kernel = color_lut.enabled() ? &ErrorDiffusion::diffuse<quantize_table, false>
+                : &ErrorDiffusion::diffuse<quantize_search, false>;
+        else
+            kernel = pad ? &ErrorDiffusion::diffuse<quantize_fast_unpadded, true>
+                : &ErrorDiffusion::diffuse<quantize_fast_unpadded, false>;
+    }
+
+    // Starts a new frame
+    void begin(unsigned width) {
+        for(auto& r : rows)
+            r.assign((width + 2) * 3, 0);
+        current = 0;
+    }
+
+    // Quantizes one row and spreads its error
+    void row(const uint8_t* rgb, uint32_t* out, unsigned width) {
+        (this->*kernel)(rgb, out, width);
+    }
+};
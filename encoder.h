@@ -0,0 +1,409 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum color_mode_t { COLOR_256, COLOR_TRUE };
+
+/* Writes out every buffer, retrying short writes. `v` is used up in the
+ * process. Returns 0 on success, -1 with errno set if the write failed.
+ */
+static int write_all(int fd, struct iovec* v, int n) {
+    while(n > 0) {
+        ssize_t written = writev(fd, v, std::min(n, IOV_MAX));
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        // skip what went out, possibly ending inside a buffer
+        while(n > 0 && (size_t)written >= v->iov_len) {
+            written -= v->iov_len;
+            v++;
+            n--;
+        }
+        if(n > 0) {
+            v->iov_base = (char*)v->iov_base + written;
+            v->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/* Frame output encoder.
+ *
+ * Cells hold a palette index in 256 color mode and 0xRRGGBB in truecolor
+ * mode. Color escapes come from precomputed tables and are left out when a
+ * cell has the same color as the one before it. The whole frame is written
+ * out with a single writev(2).
+ *
+ * In half block mode the grid has two rows of pixels for every row of cells.
+ * Each pair is drawn with an upper or lower half block in whichever
+ * orientation needs the fewest color changes, with foreground and background
+ * escapes left out independently.
+ *
+ * The encoder keeps the last frame's cells so that, with delta output on,
+ * only changed runs are redrawn using relative cursor movement. It falls
+ * back to a full repaint after a resize, when most of the frame changed, or
+ * when the delta came out bigger than the last full repaint.
+ *
+ * Frames are always encoded in bands of RENDER_BAND_ROWS rows, each into its
+ * own preallocated buffer, so the bands can be encoded in parallel and the
+ * output does not depend on how many threads did the work.
+ */
+class FrameEncoder {
+  private:
+    struct sgr_t {
+        uint8_t len;
+        char str[15];
+    };
+    static constexpr size_t MAX_CELL_BYTES = 19 + 1;      // "\x1B[48;2;255;255;255m" + ' '
+    static constexpr size_t MAX_HALF_CELL_BYTES = 36 + 3; // "\x1B[38;2;255;255;255;48;2;255;255;255m" + half block
+    static constexpr size_t MAX_ROW_BYTES = 16;      // line ends or cursor movement
+    static constexpr unsigned MERGE_GAP = 4;         // unchanged cells worth redrawing instead of a jump
+
+    struct band_t {
+        std::vector<char> buffer;
+        char* p = nullptr;
+        size_t changed = 0;
+
+        void reserve(size_t n) {
+            if(buffer.size() < n)
+                buffer.resize(n);
+            p = buffer.data();
+        }
+        void put(const char* s, size_t n) {
+            memcpy(p, s, n);
+            p += n;
+        }
+        size_t size(void) const { return p - buffer.data(); }
+    };
+
+    sgr_t sgr[256];   // background
+    sgr_t fgSgr[256]; // foreground
+    sgr_t dec[256];   // ";0" .. ";255" for truecolor
+    band_t head; // cursor movement ahead of the frame
+    std::vector<band_t> bands;
+    std::vector<struct iovec> iov;
+    unsigned bandCount = 0;
+    size_t frameBytes = 0;
+    size_t totalBytes = 0;
+    unsigned frames = 0;
+
+    std::vector<uint32_t> previous;
+    unsigned prevWidth = 0, prevHeight = 0;
+    size_t lastFullBytes = 0;
+    unsigned fullFrames = 0, deltaFrames = 0;
+
+    size_t bandBytes(void) const {
+        size_t n = 0;
+        for(unsigned i = 0; i < bandCount; ++i)
+            n += bands[i].size();
+        return n;
+    }
+
+    // The parameters of a color escape without the leading "\x1B[" and trailing 'm'
+    void putParams(band_t& b, const char* layer, uint32_t c) const {
+        if(colorMode == COLOR_256) {
+            const sgr_t& s = sgr[c & 0xFF];
+            b.put(layer, 2);
+            b.put(s.str + 4, s.len - 5);
+        } else {
+            b.put(layer, 2);
+            b.put(";2", 2);
+            b.put(dec[(c >> 16) & 0xFF].str, dec[(c >> 16) & 0xFF].len);
+            b.put(dec[(c >> 8) & 0xFF].str, dec[(c >> 8) & 0xFF].len);
+            b.put(dec[c & 0xFF].str, dec[c & 0xFF].len);
+        }
+    }
+    void setFg(band_t& b, uint32_t c, uint32_t& fg) const {
+        if(colorMode == COLOR_256) {
+            b.put(fgSgr[c & 0xFF].str, fgSgr[c & 0xFF].len);
+        } else {
+            b.put("\x1B[", 2);
+            putParams(b, "38", c);
+            *b.p++ = 'm';
+        }
+        fg = c;
+    }
+    void setBg(band_t& b, uint32_t c, uint32_t& bg) const {
+        if(colorMode == COLOR_256) {
+            b.put(sgr[c & 0xFF].str, sgr[c & 0xFF].len);
+        } else {
+            b.put("\x1B[", 2);
+            putParams(b, "48", c);
+            *b.p++ = 'm';
+        }
+        bg = c;
+    }
+    // One escape for both
+    void setBoth(band_t& b, uint32_t f, uint32_t bgc, uint32_t& fg, uint32_t& bg) const {
+        b.put("\x1B[", 2);
+        putParams(b, "38", f);
+        *b.p++ = ';';
+        putParams(b, "48", bgc);
+        *b.p++ = 'm';
+        fg = f;
+        bg = bgc;
+    }
+
+    /* Writes one cell, leaving out whatever colors the terminal already has.
+     * Outside half block mode only `top` is drawn.
+     */
+    void putCell(band_t& b, uint32_t top, uint32_t bottom, uint32_t& fg, uint32_t& bg) const {
+        if(!halfBlocks) {
+            if(top != bg)
+                setBg(b, top, bg);
+            *b.p++ = ' ';
+            return;
+        }
+        if(top == bottom) {
+            if(bg == top) {
+                *b.p++ = ' ';
+            } else if(fg == top) {
+                b.put("\xE2\x96\x88", 3); // full block
+            } else {
+                setBg(b, top, bg);
+                *b.p++ = ' ';
+            }
+            return;
+        }
+        bool upper = true;
+        if(fg == top && bg == bottom)
+            upper = true;
+        else if(fg == bottom && bg == top)
+            upper = false;
+        else if(bg == bottom)
+            setFg(b, top, fg);
+        else if(bg == top)
+            setFg(b, bottom, fg), upper = false;
+        else if(fg == top)
+            setBg(b, bottom, bg);
+        else if(fg == bottom)
+            setBg(b, top, bg), upper = false;
+        else
+            setBoth(b, top, bottom, fg, bg);
+        b.put(upper ? "\xE2\x96\x80" : "\xE2\x96\x84", 3);
+    }
+
+    unsigned pixelRows(void) const { return halfBlocks ? 2 : 1; }
+
+    void fullRows(band_t& b, const uint32_t* cells, unsigned width, unsigned y0, unsigned y1, unsigned height) {
+        b.p = b.buffer.data();
+        for(unsigned y = y0; y < y1; ++y) {
+            const uint32_t* t = cells + (size_t)y * pixelRows() * width;
+            const uint32_t* u = t + (pixelRows() - 1) * width;
+            uint32_t fg = ~0u, bg = ~0u;
+            for(unsigned x = 0; x < width; ++x)
+                putCell(b, t[x], u[x], fg, bg);
+            b.put("\x1B[0m", 4);
+            if(y == height - 1)
+                b.put("\x1B[m", 3);
+            else
+                *b.p++ = '\n';
+        }
+    }
+
+    /* Redraws the runs of rows [y0, y1) that differ from `previous`. A band
+     * starts in the first column of its first row and hands over in the
+     * first column of the next band's row; the last band leaves the cursor
+     * on the last row.
+     */
+    void deltaRows(band_t& b, const uint32_t* cells, unsigned width, unsigned y0, unsigned y1, unsigned height) {
+        b.p = b.buffer.data();
+        unsigned cy = y0, cx = 0;
+        uint32_t fg = ~0u, bg = ~0u;
+        const size_t lower = (size_t)(pixelRows() - 1) * width;
+        for(unsigned y = y0; y < y1; ++y) {
+            const uint32_t* t = cells + (size_t)y * pixelRows() * width;
+            const uint32_t* o = previous.data() + (size_t)y * pixelRows() * width;
+            auto differs = [&](unsigned x) { return t[x] != o[x] || t[x + lower] != o[x + lower]; };
+            unsigned x = 0;
+            while(x < width) {
+                if(!differs(x)) {
+                    ++x;
+                    continue;
+                }
+                unsigned x0 = x, x1 = x + 1, gap = 0;
+                for(x = x1; x < width; ++x) {
+                    if(differs(x)) {
+                        x1 = x + 1;
+                        gap = 0;
+                    } else if(++gap > MERGE_GAP) {
+                        break;
+                    }
+                }
+                if(y != cy) {
+                    b.p += sprintf(b.p, "\x1B[%uE", y - cy);
+                    cy = y;
+                    cx = 0;
+                }
+                if(x0 != cx)
+                    b.p += sprintf(b.p, "\x1B[%uG", x0 + 1);
+                for(unsigned i = x0; i < x1; ++i)
+                    putCell(b, t[i], t[i + lower], fg, bg);
+                cx = x = x1;
+            }
+        }
+        if(y1 < height) {
+            b.p += sprintf(b.p, "\x1B[%uE", y1 - cy);
+        } else {
+            if(cy != height - 1)
+                b.p += sprintf(b.p, "\x1B[%uE", height - 1 - cy);
+            b.put("\x1B[0m", 4);
+        }
+    }
+
+    size_t changedCells(const uint32_t* cells, unsigned width, unsigned y0, unsigned y1) const {
+        size_t changed = 0;
+        for(size_t i = (size_t)y0 * pixelRows() * width; i < (size_t)y1 * pixelRows() * width; ++i)
+            changed += cells[i] != previous[i];
+        return changed;
+    }
+
+    // Counts the frame as written and empties the buffers
+    void finish(void) {
+        totalBytes += frameBytes;
+        frames++;
+        head.p = head.buffer.data();
+        for(unsigned i = 0; i < bandCount; ++i)
+            bands[i].p = bands[i].buffer.data();
+    }
+
+  public:
+    bool delta = true;
+    bool halfBlocks = false;
+    color_mode_t colorMode = COLOR_256;
+
+    FrameEncoder(void) {
+        for(unsigned c = 0; c < 256; ++c) {
+            sgr[c].len = snprintf(sgr[c].str, sizeof(sgr[c].str), "\x1B[48;05;%um", c);
+            fgSgr[c].len = snprintf(fgSgr[c].str, sizeof(fgSgr[c].str), "\x1B[38;05;%um", c);
+            dec[c].len = snprintf(dec[c].str, sizeof(dec[c].str), ";%u", c);
+        }
+    }
+
+    // Makes room for a whole frame and clears the previous one's output.
+    void begin(unsigned width, unsigned height) {
+        head.reserve(64);
+        bandCount = (height + RENDER_BAND_ROWS - 1) / RENDER_BAND_ROWS;
+        if(bands.size() < bandCount)
+            bands.resize(bandCount);
+        for(unsigned i = 0; i < bandCount; ++i)
+            bands[i].reserve((size_t)RENDER_BAND_ROWS * (width * (halfBlocks ? MAX_HALF_CELL_BYTES : MAX_CELL_BYTES) + MAX_ROW_BYTES)
+                    + MAX_ROW_BYTES);
+    }
+
+    void cursorUp(unsigned lines) {
+        if(lines)
+            head.p += sprintf(head.p, "\x1B[%uF", lines);
+    }
+
+    // Erases from the cursor to the end of the screen
+    void clearBelow(void) {
+        head.put("\x1B[J", 3);
+    }
+
+    /* Encodes a whole frame of cells, as a delta against the last one when
+     * that is cheaper. In half block mode `cells` holds 2 * height rows.
+     * `run(count, fn)` must call fn(0) .. fn(count - 1) and return once all
+     * of them are done, in any order or in parallel.
+     */
+    template<typename Run>
+    void frame(const uint32_t* cells, unsigned width, unsigned height, Run run) {
+        const size_t count = (size_t)width * height * pixelRows();
+        auto rows = [&](unsigned i, unsigned& y0, unsigned& y1) {
+            y0 = i * RENDER_BAND_ROWS;
+            y1 = std::min(y0 + RENDER_BAND_ROWS, height);
+        };
+
+        bool full = !delta || width != prevWidth || height != prevHeight;
+        if(!full) {
+            run(bandCount, [&](unsigned i) {
+                unsigned y0, y1;
+                rows(i, y0, y1);
+                bands[i].changed = changedCells(cells, width, y0, y1);
+            });
+            size_t changed = 0;
+            for(unsigned i = 0; i < bandCount; ++i)
+                changed += bands[i].changed;
+            if(changed * 2 > count) {
+                full = true;
+            } else {
+                run(bandCount, [&](unsigned i) {
+                    unsigned y0, y1;
+                    rows(i, y0, y1);
+                    deltaRows(bands[i], cells, width, y0, y1, height);
+                });
+                full = bandBytes() > lastFullBytes;
+            }
+        }
+        if(full) {
+            run(bandCount, [&](unsigned i) {
+                unsigned y0, y1;
+                rows(i, y0, y1);
+                fullRows(bands[i], cells, width, y0, y1, height);
+            });
+            lastFullBytes = bandBytes();
+            fullFrames++;
+        } else {
+            deltaFrames++;
+        }
+        previous.assign(cells, cells + count);
+        prevWidth = width;
+        prevHeight = height;
+    }
+
+    void frame(const uint32_t* cells, unsigned width, unsigned height) {
+        frame(cells, width, height, [](unsigned count, auto const& fn) {
+            for(unsigned i = 0; i < count; ++i)
+                fn(i);
+        });
+    }
+
+    // Forces the next frame to be a full repaint.
+    void invalidate(void) {
+        prevWidth = prevHeight = 0;
+    }
+
+    size_t size(void) const { return head.size() + bandBytes(); }
+
+    // Returns 0 on success, -1 with errno set if the write failed.
+    int flush(int fd) {
+        fflush(stdout); // anything printed through stdio goes first
+        iov.clear();
+        if(head.size())
+            iov.push_back({head.buffer.data(), head.size()});
+        for(unsigned i = 0; i < bandCount; ++i)
+            if(bands[i].size())
+                iov.push_back({bands[i].buffer.data(), bands[i].size()});
+        frameBytes = size();
+        if(write_all(fd, iov.data(), iov.size()) < 0)
+            return -1;
+        finish();
+        return 0;
+    }
+
+    // Hands the frame to `out` instead of writing it, otherwise just like flush()
+    void take(std::string& out) {
+        out.clear();
+        out.append(head.buffer.data(), head.size());
+        for(unsigned i = 0; i < bandCount; ++i)
+            out.append(bands[i].buffer.data(), bands[i].size());
+        frameBytes = out.size();
+        finish();
+    }
+
+    size_t lastFrameBytes(void) const { return frameBytes; }
+    size_t bytesWritten(void) const { return totalBytes; }
+    unsigned framesWritten(void) const { return frames; }
+    unsigned fullFramesEncoded(void) const { return fullFrames; }
+    unsigned deltaFramesEncoded(void) const { return deltaFrames; }
+};
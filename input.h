@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Custom inputs for libavformat.
+ *
+ * "-" (stdin) and FIFOs are read through a pipe reader that never seeks, so
+ * demuxers that can do without seeking work on live captures and on other
+ * tools' output. Regular files of at least READAHEAD_MIN_BYTES are read
+ * with the kernel told they are read in order and asked to have
+ * READAHEAD_BYTES ahead of the demuxer in the page cache, so a read() per
+ * buffer seldom waits on the disk. Anything else is left to libavformat.
+ */
+
+enum input_kind_t { INPUT_FILE, INPUT_PIPE, INPUT_READAHEAD };
+
+class Input {
+  private:
+    input_kind_t kind = INPUT_FILE;
+    int fd = -1;
+    bool ownsFd = false;
+    off_t length = 0;
+    off_t pos = 0;
+    off_t advised = 0; // readahead has been asked for up to here
+    AVIOContext* io = nullptr;
+
+    static int readPipe(void* opaque, uint8_t* buf, int size) {
+        Input* in = (Input*)opaque;
+        ssize_t n;
+        while((n = read(in->fd, buf, size)) < 0 && errno == EINTR);
+        if(n < 0)
+            return AVERROR(errno);
+        return n ? (int)n : AVERROR_EOF;
+    }
+
+    static int readAhead(void* opaque, uint8_t* buf, int size) {
+        Input* in = (Input*)opaque;
+        if(in->pos + size > in->advised) {
+            posix_fadvise(in->fd, in->pos, READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+            in->advised = in->pos + READAHEAD_BYTES;
+        }
+        int n = readPipe(opaque, buf, size);
+        if(n > 0)
+            in->pos += n;
+        return n;
+    }
+
+    static int64_t seekFile(void* opaque, int64_t offset, int whence) {
+        Input* in = (Input*)opaque;
+        if((whence & ~AVSEEK_FORCE) == AVSEEK_SIZE)
+            return in->length;
+        off_t to = lseek(in->fd, offset, whence & ~AVSEEK_FORCE);
+        if(to < 0)
+            return AVERROR(errno);
+        in->pos = to;
+        in->advised = std::min(in->advised, in->pos); // readahead starts over from here
+        return to;
+    }
+
+    bool makeContext(void) {
+        unsigned char* buffer = (unsigned char*)av_malloc(INPUT_BUFFER_BYTES);
+        if(!buffer)
+            return false;
+        io = kind == INPUT_PIPE
+            ? avio_alloc_context(buffer, INPUT_BUFFER_BYTES, 0, this, readPipe, NULL, NULL)
+            : avio_alloc_context(buffer, INPUT_BUFFER_BYTES, 0, this, readAhead, NULL, seekFile);
+        if(!io) {
+            av_free(buffer);
+            return false;
+        }
+        io->seekable = kind == INPUT_READAHEAD ? AVIO_SEEKABLE_NORMAL : 0;
+        return true;
+    }
+
+  public:
+    ~Input(void) {
+        if(io) {
+            av_freep(&io->buffer); // libavformat may have replaced the one it was given
+            avio_context_free(&io);
+        }
+        if(ownsFd)
+            close(fd);
+    }
+
+    /* Decides how `path` is read and gets it ready. Returns false with
+     * errno set if it can't be opened; plain files are opened later, by
+     * libavformat.
+     */
+    bool open(std::string const& path) {
+        if(path == "-") {
+            fd = STDIN_FILENO;
+            kind = INPUT_PIPE;
+            return makeContext();
+        }
+        struct stat st;
+        if(stat(path.c_str(), &st) < 0)
+            return true; // not a local file, maybe a URL
+        if(S_ISFIFO(st.st_mode))
+            kind = INPUT_PIPE;
+        else if(S_ISREG(st.st_mode) && st.st_size >= READAHEAD_MIN_BYTES)
+            kind = INPUT_READAHEAD;
+        else
+            return true;
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            return false;
+        ownsFd = true;
+        if(kind == INPUT_READAHEAD) {
+            length = st.st_size;
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        return makeContext();
+    }
+
+    // The context for AVFormatContext::pb, or null to let libavformat open the file
+    AVIOContext* context(void) const { return io; }
+    input_kind_t type(void) const { return kind; }
+    const char* name(void) const {
+        return kind == INPUT_PIPE ? "pipe" : kind == INPUT_READAHEAD ? "file with readahead" : "file";
+    }
+};
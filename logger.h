@@ -8,7 +8,8 @@
 
 class Logger {
   private:
-    std::stringstream messages;
+    std::vector<std::string> messages; // the last LOG_KEEP_LINES, oldest at `next` once full
+    size_t next = 0;
     std::mutex mutex;
     std::ostream& out;
 
@@ -21,18 +22,24 @@ class Logger {
     void log(std::string msg) {
         std::lock_guard<std::mutex> lock(mutex);
 
-        auto now = std::chrono::system_clock::now();
-        std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-        auto timestr = std::put_time(std::localtime(&now_c), "%T");
-
-        messages << '[' << timestr << "] " << msg << '\n';
-
-        if(verbose)
-            out << '[' << timestr << "] " << msg << std::endl;
-
+        if(verbose) {
+            auto now = std::chrono::system_clock::now();
+            std::time_t now_c = std::chrono::system_clock::to_time_t(now);
+            out << '[' << std::put_time(std::localtime(&now_c), "%T") << "] " << msg << std::endl;
+        }
+
+        if(messages.size() < LOG_KEEP_LINES) {
+            messages.push_back(std::move(msg));
+        } else {
+            messages[next] = std::move(msg);
+            next = (next + 1) % LOG_KEEP_LINES;
+        }
     };
 
     void dump(std::ostream& o) {
-        o << messages.str() << std::flush;
+        std::lock_guard<std::mutex> lock(mutex);
+        for(size_t i = 0; i < messages.size(); ++i)
+            o << messages[(next + i) % messages.size()] << '\n';
+        o << std::flush;
     };
 };
@@ -0,0 +1,84 @@
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Loop cache.
+ *
+ * Keeps what the encoder wrote for every frame of a pass over a looping
+ * clip, so later passes are only timed writes. Frames are stored
+ * as written, each a delta against the one before it, so they have to be
+ * replayed in order and none can be skipped; the first one is a full
+ * repaint. Every frame keeps the size it was drawn at, so a pass over
+ * which the grid changes, with the terminal or the quality, is still kept.
+ * The cache gives up and frees everything as soon as the clip stops being
+ * cacheable: more than the budget, or frames that don't follow on from
+ * each other. Only going over the budget stops it from filling again on a
+ * later pass.
+ */
+
+class LoopCache {
+  public:
+    struct frame_t {
+        double pts;
+        double position; // stream time
+        std::string data;
+        unsigned width, height; // cells
+    };
+
+  private:
+    std::vector<frame_t> frames;
+    size_t bytes = 0;
+    size_t budget = 0;
+    bool filling = false;
+    bool complete = false;
+    bool exceeded = false;
+
+  public:
+    std::pair<unsigned, unsigned> tty;  // terminal size when filled, or when a resize was last let go
+
+    // Starts over. A budget of 0 turns the cache off.
+    void begin(size_t budgetBytes, std::pair<unsigned, unsigned> ttySize) {
+        drop();
+        budget = budgetBytes;
+        filling = budget > 0 && !exceeded;
+        tty = ttySize;
+    }
+
+    bool isFilling(void) const { return filling; }
+    bool isComplete(void) const { return complete; }
+    bool overBudget(void) const { return exceeded; }
+
+    /* Adds a frame, moving `data` into the cache. Returns false, having
+     * dropped everything, if the frame doesn't fit.
+     */
+    bool add(double pts, double position, std::string& data, unsigned w, unsigned h) {
+        if(!filling)
+            return false;
+        bytes += data.size() + sizeof(frame_t);
+        exceeded = bytes > budget;
+        if(exceeded) {
+            drop();
+            return false;
+        }
+        frames.push_back({pts, position, std::move(data), w, h});
+        return true;
+    }
+
+    // The pass being cached reached the end of the clip
+    void finish(void) {
+        complete = filling && !frames.empty();
+        filling = false;
+    }
+
+    // Frees everything
+    void drop(void) {
+        std::vector<frame_t>().swap(frames);
+        bytes = 0;
+        filling = complete = false;
+    }
+
+    size_t size(void) const { return frames.size(); }
+    size_t sizeBytes(void) const { return bytes; }
+    const frame_t& operator[](size_t i) const { return frames[i]; }
+};
@@ -0,0 +1,135 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Persistent work-stealing thread pool.
+ *
+ * parallelFor() deals its indices out across the workers' queues; a worker
+ * takes from the back of its own queue and steals from the front of the
+ * others' when it runs dry. The calling thread steals too, and returns
+ * once every index has run. Several threads may call parallelFor() at once.
+ */
+class ThreadPool {
+  private:
+    struct job_t {
+        std::function<void(unsigned)> const* fn;
+        std::atomic<unsigned> remaining;
+    };
+    struct task_t {
+        job_t* job;
+        unsigned index;
+    };
+    struct queue_t {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<queue_t>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<unsigned> queued{0};
+    std::atomic<unsigned> next{0};
+    bool quit = false;
+
+    bool pop(unsigned self, task_t& t) {
+        {
+            queue_t& q = *queues[self];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if(!q.tasks.empty()) {
+                t = q.tasks.back();
+                q.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for(unsigned i = 1; i < queues.size(); ++i) {
+            queue_t& q = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if(!q.tasks.empty()) {
+                t = q.tasks.front();
+                q.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void run(task_t const& t) {
+        (*t.job->fn)(t.index);
+        t.job->remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    void worker(unsigned self) {
+        for(;;) {
+            task_t t;
+            if(pop(self, t)) {
+                run(t);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]{ return quit || queued.load() > 0; });
+            if(quit)
+                return;
+        }
+    }
+
+  public:
+    // `threads` counts the calling thread, so 1 runs everything inline.
+    ThreadPool(unsigned threads) {
+        if(threads < 1)
+            threads = 1;
+        for(unsigned i = 0; i + 1 < threads; ++i)
+            queues.emplace_back(new queue_t);
+        for(unsigned i = 0; i + 1 < threads; ++i)
+            workers.emplace_back(&ThreadPool::worker, this, i);
+    }
+    ~ThreadPool(void) {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for(auto& t : workers)
+            t.join();
+    }
+
+    unsigned size(void) const { return workers.size() + 1; }
+
+    void parallelFor(unsigned count, std::function<void(unsigned)> const& fn) {
+        if(workers.empty() || count < 2) {
+            for(unsigned i = 0; i < count; ++i)
+                fn(i);
+            return;
+        }
+        job_t job;
+        job.fn = &fn;
+        job.remaining = count;
+        unsigned first = next.fetch_add(1);
+        for(unsigned i = 0; i < count; ++i) {
+            queue_t& q = *queues[(first + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back({&job, i});
+            queued++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+
+        // help out until our own job is done
+        task_t t;
+        while(job.remaining.load(std::memory_order_acquire) > 0) {
+            if(pop(first % queues.size(), t))
+                run(t);
+            else
+                std::this_thread::yield();
+        }
+    }
+};
@@ -0,0 +1,368 @@
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANTIZE_X86 1
+#include <immintrin.h>
+#endif
+
+/* Row quantization: turns a packed RGB24 row into a row of palette cells.
+ *
+ * Every kernel computes exactly what the scalar versions below compute, so the
+ * dispatcher is free to pick whichever one the CPU supports.
+ */
+
+typedef void (*quantize_row_fn)(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t pad);
+
+/* Fast (-fc) colors. This is the float/lround formulation done in integers:
+ * neither rounding ever lands on an exact half, and the scores are compared
+ * scaled by 23 so the gray level's 255/23 steps stay exact.
+ */
+static inline uint32_t quantize_fast(uint8_t r, uint8_t g, uint8_t b, uint8_t pad) {
+    int rp = r >= pad ? r - pad : 0;
+    int gp = g >= pad ? g - pad : 0;
+    int bp = b >= pad ? b - pad : 0;
+
+    int lum = (46 * (rp + gp + bp) + 765) / 1530; // 24 grayscale colors
+    int rv = (2 * rp + 51) / 102;
+    int gv = (2 * gp + 51) / 102;
+    int bv = (2 * bp + 51) / 102;
+
+    int g_score = abs(23 * rp - 255 * lum) + abs(23 * gp - 255 * lum) + abs(23 * bp - 255 * lum);
+    int c_score = 23 * (abs(rp - 51 * rv) + abs(gp - 51 * gv) + abs(bp - 51 * bv));
+
+    if(c_score < g_score + (int)(COLOR_BIAS * 23))
+        return 16 + (36 * rv) + (6 * gv) + bv;
+    return 232 + lum;
+}
+
+static inline uint32_t quantize_accurate(uint8_t r, uint8_t g, uint8_t b) {
+    if(color_lut.enabled())
+        return color_lut.lookup(r, g, b);
+    return get_closest_color((r << 16) + (g << 8) + b);
+}
+
+/* Per-pixel matches for the scalar kernels. Each kernel is instantiated
+ * with one, so whether there is a table to look in or padding to take off
+ * is settled when the kernel is picked rather than at every pixel.
+ */
+typedef uint32_t (*quantize_pixel_fn)(uint8_t r, uint8_t g, uint8_t b, uint8_t pad);
+
+static inline uint32_t quantize_fast_unpadded(uint8_t r, uint8_t g, uint8_t b, uint8_t) {
+    return quantize_fast(r, g, b, 0);
+}
+
+static inline uint32_t quantize_table(uint8_t r, uint8_t g, uint8_t b, uint8_t) {
+    return color_lut.lookup(r, g, b);
+}
+
+static inline uint32_t quantize_search(uint8_t r, uint8_t g, uint8_t b, uint8_t) {
+    return get_closest_color((r << 16) + (g << 8) + b);
+}
+
+template<quantize_pixel_fn Match>
+static void quantize_row_scalar(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t pad) {
+    for(unsigned x = 0; x < width; ++x, rgb += 3)
+        out[x] = Match(rgb[0], rgb[1], rgb[2], pad);
+}
+
+/* Truecolor cells are 0xRRGGBB. Each channel is padded, then rounded to the
+ * nearest of 2^bits levels spread over the whole 0-255 range, so that fewer
+ * bits mean longer runs of equal cells.
+ */
+static uint8_t truecolor_levels[256];
+
+static void build_truecolor_levels(unsigned bits, uint8_t pad) {
+    const unsigned steps = (1u << bits) - 1;
+    for(unsigned v = 0; v < 256; ++v) {
+        unsigned p = v >= pad ? v - pad : 0;
+        truecolor_levels[v] = ((p * steps + 127) / 255 * 255 + steps / 2) / steps;
+    }
+}
+
+static void quantize_row_truecolor(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t) {
+    const uint8_t* l = truecolor_levels;
+    for(unsigned x = 0; x < width; ++x, rgb += 3)
+        out[x] = ((uint32_t)l[rgb[0]] << 16) | ((uint32_t)l[rgb[1]] << 8) | l[rgb[2]];
+}
+
+#ifdef QUANTIZE_X86
+/* The vector loops read whole 4 or 16 byte words, so they stop while at
+ * least one pixel is left and let the scalar code finish the row. Divisions
+ * by 1530 and 102 are done as multiply+shift, exact over the input range.
+ */
+
+__attribute__((target("sse4.1")))
+static inline __m128i quantize_fast_sse41(__m128i r, __m128i g, __m128i b) {
+    const __m128i k51 = _mm_set1_epi32(51);
+    const __m128i k255 = _mm_set1_epi32(255);
+    const __m128i k23 = _mm_set1_epi32(23);
+
+    __m128i s = _mm_add_epi32(_mm_add_epi32(r, g), b);
+    __m128i lum = _mm_srli_epi32(_mm_mullo_epi32(_mm_add_epi32(_mm_mullo_epi32(s, _mm_set1_epi32(46)), _mm_set1_epi32(765)), _mm_set1_epi32(43863)), 26);
+    __m128i rv = _mm_srli_epi32(_mm_mullo_epi32(_mm_add_epi32(_mm_add_epi32(r, r), k51), _mm_set1_epi32(643)), 16);
+    __m128i gv = _mm_srli_epi32(_mm_mullo_epi32(_mm_add_epi32(_mm_add_epi32(g, g), k51), _mm_set1_epi32(643)), 16);
+    __m128i bv = _mm_srli_epi32(_mm_mullo_epi32(_mm_add_epi32(_mm_add_epi32(b, b), k51), _mm_set1_epi32(643)), 16);
+
+    __m128i l = _mm_mullo_epi32(lum, k255);
+    __m128i g_score = _mm_add_epi32(_mm_add_epi32(
+                _mm_abs_epi32(_mm_sub_epi32(_mm_mullo_epi32(r, k23), l)),
+                _mm_abs_epi32(_mm_sub_epi32(_mm_mullo_epi32(g, k23), l))),
+                _mm_abs_epi32(_mm_sub_epi32(_mm_mullo_epi32(b, k23), l)));
+    __m128i c_score = _mm_mullo_epi32(k23, _mm_add_epi32(_mm_add_epi32(
+                _mm_abs_epi32(_mm_sub_epi32(r, _mm_mullo_epi32(rv, k51))),
+                _mm_abs_epi32(_mm_sub_epi32(g, _mm_mullo_epi32(gv, k51)))),
+                _mm_abs_epi32(_mm_sub_epi32(b, _mm_mullo_epi32(bv, k51)))));
+
+    __m128i cube = _mm_add_epi32(_mm_add_epi32(_mm_set1_epi32(16), _mm_mullo_epi32(rv, _mm_set1_epi32(36))),
+            _mm_add_epi32(_mm_mullo_epi32(gv, _mm_set1_epi32(6)), bv));
+    __m128i gray = _mm_add_epi32(lum, _mm_set1_epi32(232));
+    __m128i use_cube = _mm_cmplt_epi32(c_score, _mm_add_epi32(g_score, _mm_set1_epi32((int)(COLOR_BIAS * 23))));
+    return _mm_blendv_epi8(gray, cube, use_cube);
+}
+
+__attribute__((target("sse4.1")))
+static inline void load_rgb_sse41(const uint8_t* rgb, uint8_t pad, __m128i& r, __m128i& g, __m128i& b) {
+    __m128i v = _mm_subs_epu8(_mm_loadu_si128((const __m128i*)rgb), _mm_set1_epi8((char)pad));
+    r = _mm_shuffle_epi8(v, _mm_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1));
+    g = _mm_shuffle_epi8(v, _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1));
+    b = _mm_shuffle_epi8(v, _mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1));
+}
+
+__attribute__((target("sse4.1")))
+static void quantize_row_fast_sse41(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t pad) {
+    unsigned x = 0;
+    for(; 3 * x + 16 <= 3 * width; x += 4) {
+        __m128i r, g, b;
+        load_rgb_sse41(rgb + 3 * x, pad, r, g, b);
+        _mm_storeu_si128((__m128i*)(out + x), quantize_fast_sse41(r, g, b));
+    }
+    quantize_row_scalar<quantize_fast>(rgb + 3 * x, out + x, width - x, pad);
+}
+
+__attribute__((target("sse4.1")))
+static void quantize_row_accurate_sse41(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t) {
+    const __m128i shift = _mm_cvtsi32_si128(color_lut.precision_shift());
+    const __m128i gshift = _mm_cvtsi32_si128(color_lut.resolution());
+    const __m128i rshift = _mm_cvtsi32_si128(2 * color_lut.resolution());
+    const uint8_t* table = color_lut.data();
+    alignas(16) uint32_t idx[4];
+    unsigned x = 0;
+    for(; 3 * x + 16 <= 3 * width; x += 4) {
+        __m128i r, g, b;
+        load_rgb_sse41(rgb + 3 * x, 0, r, g, b);
+        __m128i i = _mm_or_si128(_mm_or_si128(
+                    _mm_sll_epi32(_mm_srl_epi32(r, shift), rshift),
+                    _mm_sll_epi32(_mm_srl_epi32(g, shift), gshift)),
+                    _mm_srl_epi32(b, shift));
+        _mm_store_si128((__m128i*)idx, i);
+        out[x] = table[idx[0]];
+        out[x + 1] = table[idx[1]];
+        out[x + 2] = table[idx[2]];
+        out[x + 3] = table[idx[3]];
+    }
+    quantize_row_scalar<quantize_table>(rgb + 3 * x, out + x, width - x, 0);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i quantize_fast_avx2(__m256i r, __m256i g, __m256i b) {
+    const __m256i k51 = _mm256_set1_epi32(51);
+    const __m256i k255 = _mm256_set1_epi32(255);
+    const __m256i k23 = _mm256_set1_epi32(23);
+
+    __m256i s = _mm256_add_epi32(_mm256_add_epi32(r, g), b);
+    __m256i lum = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(s, _mm256_set1_epi32(46)), _mm256_set1_epi32(765)), _mm256_set1_epi32(43863)), 26);
+    __m256i rv = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(r, r), k51), _mm256_set1_epi32(643)), 16);
+    __m256i gv = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(g, g), k51), _mm256_set1_epi32(643)), 16);
+    __m256i bv = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(b, b), k51), _mm256_set1_epi32(643)), 16);
+
+    __m256i l = _mm256_mullo_epi32(lum, k255);
+    __m256i g_score = _mm256_add_epi32(_mm256_add_epi32(
+                _mm256_abs_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(r, k23), l)),
+                _mm256_abs_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(g, k23), l))),
+                _mm256_abs_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(b, k23), l)));
+    __m256i c_score = _mm256_mullo_epi32(k23, _mm256_add_epi32(_mm256_add_epi32(
+                _mm256_abs_epi32(_mm256_sub_epi32(r, _mm256_mullo_epi32(rv, k51))),
+                _mm256_abs_epi32(_mm256_sub_epi32(g, _mm256_mullo_epi32(gv, k51)))),
+                _mm256_abs_epi32(_mm256_sub_epi32(b, _mm256_mullo_epi32(bv, k51)))));
+
+    __m256i cube = _mm256_add_epi32(_mm256_add_epi32(_mm256_set1_epi32(16), _mm256_mullo_epi32(rv, _mm256_set1_epi32(36))),
+            _mm256_add_epi32(_mm256_mullo_epi32(gv, _mm256_set1_epi32(6)), bv));
+    __m256i gray = _mm256_add_epi32(lum, _mm256_set1_epi32(232));
+    __m256i use_cube = _mm256_cmpgt_epi32(_mm256_add_epi32(g_score, _mm256_set1_epi32((int)(COLOR_BIAS * 23))), c_score);
+    return _mm256_blendv_epi8(gray, cube, use_cube);
+}
+
+// one pixel per 32-bit lane, fourth byte is the next pixel's red
+__attribute__((target("avx2")))
+static inline __m256i load_rgb_avx2(const uint8_t* rgb, uint8_t pad) {
+    const __m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    __m256i v = _mm256_i32gather_epi32((const int*)rgb, offsets, 1);
+    return _mm256_subs_epu8(v, _mm256_set1_epi8((char)pad));
+}
+
+__attribute__((target("avx2")))
+static void quantize_row_fast_avx2(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t pad) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    unsigned x = 0;
+    for(; x + 8 < width; x += 8) {
+        __m256i v = load_rgb_avx2(rgb + 3 * x, pad);
+        __m256i r = _mm256_and_si256(v, mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+        _mm256_storeu_si256((__m256i*)(out + x), quantize_fast_avx2(r, g, b));
+    }
+    quantize_row_scalar<quantize_fast>(rgb + 3 * x, out + x, width - x, pad);
+}
+
+__attribute__((target("avx2")))
+static void quantize_row_accurate_avx2(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    const __m128i shift = _mm_cvtsi32_si128(color_lut.precision_shift());
+    const __m128i gshift = _mm_cvtsi32_si128(color_lut.resolution());
+    const __m128i rshift = _mm_cvtsi32_si128(2 * color_lut.resolution());
+    const int* table = (const int*)color_lut.data();
+    unsigned x = 0;
+    for(; x + 8 < width; x += 8) {
+        __m256i v = load_rgb_avx2(rgb + 3 * x, 0);
+        __m256i r = _mm256_and_si256(v, mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+        __m256i i = _mm256_or_si256(_mm256_or_si256(
+                    _mm256_sll_epi32(_mm256_srl_epi32(r, shift), rshift),
+                    _mm256_sll_epi32(_mm256_srl_epi32(g, shift), gshift)),
+                    _mm256_srl_epi32(b, shift));
+        _mm256_storeu_si256((__m256i*)(out + x), _mm256_and_si256(_mm256_i32gather_epi32(table, i, 1), mask));
+    }
+    quantize_row_scalar<quantize_table>(rgb + 3 * x, out + x, width - x, 0);
+}
+
+// GCC 12 warns about the undefined vectors its own AVX-512 headers use
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i quantize_fast_avx512(__m512i r, __m512i g, __m512i b) {
+    const __m512i k51 = _mm512_set1_epi32(51);
+    const __m512i k255 = _mm512_set1_epi32(255);
+    const __m512i k23 = _mm512_set1_epi32(23);
+
+    __m512i s = _mm512_add_epi32(_mm512_add_epi32(r, g), b);
+    __m512i lum = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_add_epi32(_mm512_mullo_epi32(s, _mm512_set1_epi32(46)), _mm512_set1_epi32(765)), _mm512_set1_epi32(43863)), 26);
+    __m512i rv = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_add_epi32(_mm512_add_epi32(r, r), k51), _mm512_set1_epi32(643)), 16);
+    __m512i gv = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_add_epi32(_mm512_add_epi32(g, g), k51), _mm512_set1_epi32(643)), 16);
+    __m512i bv = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_add_epi32(_mm512_add_epi32(b, b), k51), _mm512_set1_epi32(643)), 16);
+
+    __m512i l = _mm512_mullo_epi32(lum, k255);
+    __m512i g_score = _mm512_add_epi32(_mm512_add_epi32(
+                _mm512_abs_epi32(_mm512_sub_epi32(_mm512_mullo_epi32(r, k23), l)),
+                _mm512_abs_epi32(_mm512_sub_epi32(_mm512_mullo_epi32(g, k23), l))),
+                _mm512_abs_epi32(_mm512_sub_epi32(_mm512_mullo_epi32(b, k23), l)));
+    __m512i c_score = _mm512_mullo_epi32(k23, _mm512_add_epi32(_mm512_add_epi32(
+                _mm512_abs_epi32(_mm512_sub_epi32(r, _mm512_mullo_epi32(rv, k51))),
+                _mm512_abs_epi32(_mm512_sub_epi32(g, _mm512_mullo_epi32(gv, k51)))),
+                _mm512_abs_epi32(_mm512_sub_epi32(b, _mm512_mullo_epi32(bv, k51)))));
+
+    __m512i cube = _mm512_add_epi32(_mm512_add_epi32(_mm512_set1_epi32(16), _mm512_mullo_epi32(rv, _mm512_set1_epi32(36))),
+            _mm512_add_epi32(_mm512_mullo_epi32(gv, _mm512_set1_epi32(6)), bv));
+    __m512i gray = _mm512_add_epi32(lum, _mm512_set1_epi32(232));
+    __mmask16 use_cube = _mm512_cmplt_epi32_mask(c_score, _mm512_add_epi32(g_score, _mm512_set1_epi32((int)(COLOR_BIAS * 23))));
+    return _mm512_mask_blend_epi32(use_cube, gray, cube);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i load_rgb_avx512(const uint8_t* rgb, uint8_t pad) {
+    const __m512i offsets = _mm512_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 33, 36, 39, 42, 45);
+    __m512i v = _mm512_i32gather_epi32(offsets, (const int*)rgb, 1);
+    return _mm512_subs_epu8(v, _mm512_set1_epi8((char)pad));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void quantize_row_fast_avx512(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t pad) {
+    const __m512i mask = _mm512_set1_epi32(0xFF);
+    unsigned x = 0;
+    for(; x + 16 < width; x += 16) {
+        __m512i v = load_rgb_avx512(rgb + 3 * x, pad);
+        __m512i r = _mm512_and_si512(v, mask);
+        __m512i g = _mm512_and_si512(_mm512_srli_epi32(v, 8), mask);
+        __m512i b = _mm512_and_si512(_mm512_srli_epi32(v, 16), mask);
+        _mm512_storeu_si512((void*)(out + x), quantize_fast_avx512(r, g, b));
+    }
+    quantize_row_scalar<quantize_fast>(rgb + 3 * x, out + x, width - x, pad);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void quantize_row_accurate_avx512(const uint8_t* rgb, uint32_t* out, unsigned width, uint8_t) {
+    const __m512i mask = _mm512_set1_epi32(0xFF);
+    const __m128i shift = _mm_cvtsi32_si128(color_lut.precision_shift());
+    const __m128i gshift = _mm_cvtsi32_si128(color_lut.resolution());
+    const __m128i rshift = _mm_cvtsi32_si128(2 * color_lut.resolution());
+    const int* table = (const int*)color_lut.data();
+    unsigned x = 0;
+    for(; x + 16 < width; x += 16) {
+        __m512i v = load_rgb_avx512(rgb + 3 * x, 0);
+        __m512i r = _mm512_and_si512(v, mask);
+        __m512i g = _mm512_and_si512(_mm512_srli_epi32(v, 8), mask);
+        __m512i b = _mm512_and_si512(_mm512_srli_epi32(v, 16), mask);
+        __m512i i = _mm512_or_si512(_mm512_or_si512(
+                    _mm512_sll_epi32(_mm512_srl_epi32(r, shift), rshift),
+                    _mm512_sll_epi32(_mm512_srl_epi32(g, shift), gshift)),
+                    _mm512_srl_epi32(b, shift));
+        _mm512_storeu_si512((void*)(out + x), _mm512_and_si512(_mm512_i32gather_epi32(i, table, 1), mask));
+    }
+    quantize_row_scalar<quantize_table>(rgb + 3 * x, out + x, width - x, 0);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+enum quantize_isa_t { ISA_SCALAR, ISA_SSE41, ISA_AVX2, ISA_AVX512 };
+
+static quantize_isa_t detect_quantize_isa(void) {
+#ifdef QUANTIZE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return ISA_AVX512;
+    if(__builtin_cpu_supports("avx2"))
+        return ISA_AVX2;
+    if(__builtin_cpu_supports("sse4.1"))
+        return ISA_SSE41;
+#endif
+    return ISA_SCALAR;
+}
+
+static const char* quantize_isa_name(quantize_isa_t isa) {
+    switch(isa) {
+        case ISA_AVX512: return "avx512";
+        case ISA_AVX2: return "avx2";
+        case ISA_SSE41: return "sse4.1";
+        default: return "scalar";
+    }
+}
+
+/* Picks the row kernel for a color mode. The vector accurate kernels index
+ * the lookup table directly, so without one only the scalar scan is left.
+ * The vector fast kernels take padding off whole registers at a time, so
+ * only the scalar one is worth having without it.
+ */
+static quantize_row_fn select_quantize_row(bool accurate, quantize_isa_t isa, uint8_t pad) {
+    if(accurate && !color_lut.enabled())
+        return quantize_row_scalar<quantize_search>;
+#ifdef QUANTIZE_X86
+    switch(isa) {
+        case ISA_AVX512:
+            return accurate ? quantize_row_accurate_avx512 : quantize_row_fast_avx512;
+        case ISA_AVX2:
+            return accurate ? quantize_row_accurate_avx2 : quantize_row_fast_avx2;
+        case ISA_SSE41:
+            return accurate ? quantize_row_accurate_sse41 : quantize_row_fast_sse41;
+        default:
+            break;
+    }
+#else
+    (void)isa;
+#endif
+    if(accurate)
+        return quantize_row_scalar<quantize_table>;
+    return pad ? quantize_row_scalar<quantize_fast> : quantize_row_scalar<quantize_fast_unpadded>;
+}
@@ -0,0 +1,121 @@
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <string>
+
+/* Frame recorder.
+ *
+ * Writes encoded frames to a file instead of a terminal, each stamped with
+ * its presentation time, in one of two standard formats:
+ *
+ * asciicast v2: a JSON header line with the terminal size, then one
+ *     [seconds, "o", data] line per frame.
+ * ttyrec: per frame a little endian (seconds, microseconds, length) header
+ *     followed by the raw bytes.
+ *
+ * Times start at 0 with the first frame.
+ */
+
+enum record_format_t { RECORD_ASCIICAST, RECORD_TTYREC };
+
+class Recorder {
+  private:
+    FILE* file = nullptr;
+    record_format_t format = RECORD_TTYREC;
+    std::string line;
+    bool started = false;
+    double first = 0;
+    unsigned frames = 0;
+
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    // Appends `data` as the inside of a JSON string
+    void escape(std::string const& data) {
+        static const char hex[] = "0123456789abcdef";
+        for(unsigned char c : data) {
+            if(c == '"' || c == '\\') {
+                line += '\\';
+                line += c;
+            } else if(c < 0x20 || c == 0x7F) {
+                line += "\\u00";
+                line += hex[c >> 4];
+                line += hex[c & 0xF];
+            } else {
+                line += c; // UTF-8 passes through as is
+            }
+        }
+    }
+
+    bool putUint32(uint32_t v) {
+        unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+        return fwrite(b, 1, 4, file) == 4;
+    }
+
+  public:
+    // Files ending in .cast are asciicast, anything else ttyrec
+    static record_format_t formatFor(std::string const& path) {
+        const std::string ext = ".cast";
+        if(path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0)
+            return RECORD_ASCIICAST;
+        return RECORD_TTYREC;
+    }
+
+    ~Recorder(void) {
+        close();
+    }
+
+    // Returns false if the file couldn't be created
+    bool open(std::string const& path) {
+        close();
+        file = fopen(path.c_str(), "wb");
+        if(!file)
+            return false;
+        setvbuf(file, NULL, _IOFBF, BUFFER_SIZE);
+        format = formatFor(path);
+        started = false;
+        frames = 0;
+        return true;
+    }
+
+    bool isOpen(void) const { return file != nullptr; }
+    unsigned framesRecorded(void) const { return frames; }
+
+    /* Records one frame shown at `pts` seconds into the stream. The cell
+     * size of the first frame goes into the asciicast header. Returns false
+     * if writing failed.
+     */
+    bool frame(double pts, std::string const& data, unsigned width, unsigned height) {
+        if(!started) {
+            started = true;
+            first = pts;
+            if(format == RECORD_ASCIICAST
+                    && fprintf(file, "{\"version\": 2, \"width\": %u, \"height\": %u, \"timestamp\": %lld, "
+                        "\"env\": {\"TERM\": \"xterm-256color\"}}\n", width, height, (long long)time(NULL)) < 0)
+                return false;
+        }
+        double t = std::max(pts - first, 0.0);
+        frames++;
+        if(format == RECORD_ASCIICAST) {
+            char stamp[32];
+            int n = snprintf(stamp, sizeof(stamp), "[%.6f, \"o\", \"", t);
+            line.assign(stamp, n);
+            escape(data);
+            line += "\"]\n";
+            return fwrite(line.data(), 1, line.size(), file) == line.size();
+        }
+        long long us = llround(t * 1e6);
+        return putUint32(us / 1000000) && putUint32(us % 1000000) && putUint32(data.size())
+            && fwrite(data.data(), 1, data.size(), file) == data.size();
+    }
+
+    // Returns false if anything still buffered couldn't be written
+    bool close(void) {
+        if(!file)
+            return true;
+        bool ok = fclose(file) == 0;
+        file = nullptr;
+        return ok;
+    }
+};
@@ -0,0 +1,86 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/* Bounded single-producer/single-consumer ring of preallocated slots.
+ *
+ * The producer fills writeSlot() in place and publishes it with push(); the
+ * consumer reads readSlot() in place and hands it back with pop(). Slots are
+ * never constructed or destroyed while the ring is in use, so whatever they
+ * own (frames, cell grids) is reused from one lap to the next.
+ */
+template<typename T>
+class SpscRing {
+  private:
+    std::vector<T> slots;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // next slot to read
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to write
+
+    static size_t roundUp(size_t n) {
+        size_t p = 1;
+        while(p < n)
+            p <<= 1;
+        return p;
+    }
+
+  public:
+    SpscRing(size_t capacity) : slots(roundUp(capacity)), mask(roundUp(capacity) - 1) { }
+
+    T* writeSlot(void) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == slots.size())
+            return nullptr;
+        return &slots[t & mask];
+    }
+    void push(void) {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    T* readSlot(void) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(tail.load(std::memory_order_acquire) == h)
+            return nullptr;
+        return &slots[h & mask];
+    }
+    // Slot `ahead` places after readSlot(), if it has been pushed yet
+    T* peekSlot(size_t ahead) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(tail.load(std::memory_order_acquire) - h <= ahead)
+            return nullptr;
+        return &slots[(h + ahead) & mask];
+    }
+    void pop(void) {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Only while neither side is running
+    void clear(void) {
+        head.store(0);
+        tail.store(0);
+    }
+
+    typename std::vector<T>::iterator begin(void) { return slots.begin(); }
+    typename std::vector<T>::iterator end(void) { return slots.end(); }
+};
+
+/* Waits for a ring operation to return a slot: spins briefly, then yields,
+ * then sleeps. Returns nullptr once stopped() is true.
+ */
+template<typename F, typename S>
+static auto ring_wait(F tryGet, S stopped) -> decltype(tryGet()) {
+    for(unsigned i = 0; ; ++i) {
+        auto slot = tryGet();
+        if(slot != nullptr)
+            return slot;
+        if(stopped())
+            return nullptr;
+        if(i < 64)
+            continue;
+        if(i < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
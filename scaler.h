@@ -0,0 +1,133 @@
+#include <vector>
+
+/* Scaling stage.
+ *
+ * Keeps one SwsContext and a small pool of output frames for the current
+ * source (dims, format, chroma siting, matrix, range) and target (dims,
+ * format). They are only rebuilt when one of those changes, so steady-state
+ * playback allocates nothing per frame.
+ *
+ * YUV sources are scaled with their chroma siting and, when converted to
+ * RGB, with their own matrix and range. Scaling YUV to YUV keeps the range as
+ * it is, leaving it to the quantization table.
+ */
+class Scaler {
+  private:
+    struct key_t {
+        int srcWidth = 0, srcHeight = 0, srcFormat = AV_PIX_FMT_NONE;
+        int chromaLocation = AVCHROMA_LOC_UNSPECIFIED, matrix = AVCOL_SPC_UNSPECIFIED;
+        bool fullRange = false;
+        int width = 0, height = 0, format = AV_PIX_FMT_NONE;
+
+        bool operator==(key_t const& o) const {
+            return srcWidth == o.srcWidth && srcHeight == o.srcHeight && srcFormat == o.srcFormat
+                && chromaLocation == o.chromaLocation && matrix == o.matrix && fullRange == o.fullRange
+                && width == o.width && height == o.height && format == o.format;
+        }
+    } key;
+
+    struct SwsContext* context = nullptr;
+    std::vector<AVFrame*> pool;
+    unsigned next = 0;
+    unsigned rebuilds = 0;
+
+    void release(void) {
+        for(auto& f : pool)
+            av_frame_free(&f);
+        pool.clear();
+        if(context != nullptr) {
+            sws_freeContext(context);
+            context = nullptr;
+        }
+    }
+
+    bool rebuild(key_t const& k) {
+        release();
+        key = k;
+        rebuilds++;
+        context = sws_alloc_context();
+        if(!context)
+            return false;
+        av_opt_set_int(context, "srcw", k.srcWidth, 0);
+        av_opt_set_int(context, "srch", k.srcHeight, 0);
+        av_opt_set_int(context, "src_format", k.srcFormat, 0);
+        av_opt_set_int(context, "dstw", k.width, 0);
+        av_opt_set_int(context, "dsth", k.height, 0);
+        av_opt_set_int(context, "dst_format", k.format, 0);
+        av_opt_set_int(context, "sws_flags", flags, 0);
+        int x, y;
+        if(avcodec_enum_to_chroma_pos(&x, &y, (AVChromaLocation)k.chromaLocation) == 0) {
+            av_opt_set_int(context, "src_h_chr_pos", x, 0);
+            av_opt_set_int(context, "src_v_chr_pos", y, 0);
+        }
+        if(sws_init_context(context, NULL, NULL) < 0)
+            return false;
+        if(yuv_source(k.srcFormat)) {
+            const int* coefficients = sws_getCoefficients(k.matrix);
+            if(yuv_source(k.format))
+                sws_setColorspaceDetails(context, coefficients, 1, coefficients, 1, 0, 1 << 16, 1 << 16);
+            else
+                sws_setColorspaceDetails(context, coefficients, k.fullRange, sws_getCoefficients(SWS_CS_DEFAULT), 1,
+                        0, 1 << 16, 1 << 16);
+        }
+        for(unsigned i = 0; i < poolSize; ++i) {
+            AVFrame* f = av_frame_alloc();
+            if(!f)
+                return false;
+            f->format = k.format;
+            f->width = k.width;
+            f->height = k.height;
+            // 32-byte aligned rows with padding, so vector kernels can over-read
+            if(av_frame_get_buffer(f, 32) < 0) {
+                av_frame_free(&f);
+                return false;
+            }
+            pool.push_back(f);
+        }
+        next = 0;
+        return true;
+    }
+
+  public:
+    const int flags = SWS_BICUBIC;
+    const unsigned poolSize;
+
+    /* A frame returned by scale() stays valid until poolSize more frames have
+     * been scaled.
+     */
+    Scaler(unsigned size = 2) : poolSize(size) { }
+    ~Scaler(void) {
+        release();
+    }
+
+    AVFrame* scale(const AVFrame* frame, unsigned width, unsigned height, AVPixelFormat format) {
+        key_t k;
+        k.srcWidth = frame->width;
+        k.srcHeight = frame->height;
+        k.srcFormat = frame->format;
+        k.width = width;
+        k.height = height;
+        k.format = format;
+        if(yuv_source(frame->format)) {
+            // untagged 4:2:0 is taken to be MPEG-2/H.264 style, left of center
+            k.chromaLocation = frame->chroma_location;
+            if(k.chromaLocation == AVCHROMA_LOC_UNSPECIFIED)
+                k.chromaLocation = AVCHROMA_LOC_LEFT;
+            k.matrix = yuv_matrix(frame);
+            k.fullRange = yuv_full_range(frame);
+        }
+        if(!(k == key) || pool.empty()) {
+            if(!rebuild(k)) {
+                release();
+                key = key_t();
+                return nullptr;
+            }
+        }
+        AVFrame* out = pool[next];
+        next = (next + 1) % pool.size();
+        sws_scale(context, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height, out->data, out->linesize);
+        return out;
+    }
+
+    unsigned rebuildCount(void) const { return rebuilds; }
+};
@@ -0,0 +1,105 @@
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cerrno>
+#include <mutex>
+
+/* Presentation scheduler.
+ *
+ * Maps frame timestamps (in seconds) onto a monotonic playback clock that
+ * starts with the first frame, and restarts whenever timestamps jump back or
+ * leap ahead. Frames that are already later than LATE_THRESHOLD_NS should
+ * be dropped; every few drops the decoder skip level goes up a step, and a
+ * run of frames shown on time brings it back down.
+ *
+ * Time spent paused is added with shift(). Deadlines come out of deadline()
+ * unshifted and go through shifted() when used, so frames already in flight
+ * when playback resumes are moved along with the rest.
+ *
+ * deadline() belongs to a single thread; drop(), shown(), shift() and
+ * shifted() may be called from any.
+ */
+class Scheduler {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr int MAX_SKIP_LEVEL = 3;
+    static constexpr unsigned DROPS_PER_LEVEL = 3;
+    static constexpr unsigned ON_TIME_PER_LEVEL = 60;
+    static constexpr double MAX_GAP = 5.0; // seconds between frames before we resync
+
+  private:
+    clock::time_point origin;
+    double originPts = 0, lastPts = 0;
+    bool started = false;
+    std::mutex mutex;
+    unsigned drops = 0, onTime = 0;
+    std::atomic<int> level{0};
+    std::atomic<unsigned> dropped{0};
+    std::atomic<clock::rep> paused{0};
+
+  public:
+    void reset(void) {
+        started = false;
+    }
+
+    clock::time_point deadline(double pts) {
+        if(!started || pts < lastPts || pts - lastPts > MAX_GAP) {
+            origin = clock::now() - clock::duration(paused.load());
+            originPts = pts;
+            started = true;
+        }
+        lastPts = pts;
+        return origin + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(pts - originPts));
+    }
+
+    // Pushes every deadline back by `d`
+    void shift(clock::duration d) {
+        paused += d.count();
+    }
+    clock::time_point shifted(clock::time_point deadline) const {
+        return deadline + clock::duration(paused.load());
+    }
+
+    bool running(void) const { return started; }
+    double previousPts(void) const { return lastPts; }
+
+    static bool late(clock::time_point due, clock::time_point now) {
+        return now - due > std::chrono::nanoseconds((long long)LATE_THRESHOLD_NS);
+    }
+
+    void shown(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        drops = 0;
+        if(level > 0 && ++onTime >= ON_TIME_PER_LEVEL) {
+            level--;
+            onTime = 0;
+        }
+    }
+
+    void drop(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        dropped++;
+        onTime = 0;
+        if(++drops >= DROPS_PER_LEVEL) {
+            drops = 0;
+            if(level < MAX_SKIP_LEVEL)
+                level++;
+        }
+    }
+
+    // How much work the decoder should skip, from 0 (none) to MAX_SKIP_LEVEL
+    int skipLevel(void) const { return level.load(std::memory_order_relaxed); }
+    unsigned droppedFrames(void) const { return dropped; }
+
+    // Sleeps until an absolute point on the monotonic clock
+    static void sleepUntil(clock::time_point when) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+        if(ns <= 0)
+            return;
+        struct timespec ts;
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+};
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Fan-out server.
+ *
+ * One process decodes and serves any number of viewers over a Unix socket.
+ * A viewer connects and sends a hello_t with its terminal size and colour
+ * mode, and again whenever either changes; from then on it only reads.
+ *
+ * The stream puts viewers with the same grid size and colour mode in a
+ * group and encodes each frame once per group. Encoded frames are shared
+ * between the group's viewers as reference counted buffers and written
+ * straight out of them. Every viewer has its own queue of SERVE_QUEUE_FRAMES;
+ * a viewer that can't keep up has its queue emptied instead of holding the
+ * others back, and gets a full repaint next so its screen is right again.
+ */
+
+static const char SERVE_MAGIC[8] = {'T', 'T', 'Y', 'D', 'S', 'R', 'V', '\n'};
+
+struct hello_t {
+    char magic[8];
+    uint16_t width, height; // terminal cells
+    uint8_t colorMode;
+    uint8_t reserved[3];
+};
+
+class FanoutServer {
+  public:
+    using buffer_t = std::shared_ptr<const std::string>;
+
+    // A frame for one group: `delta` against the frame before, or a `full` repaint when asked for
+    struct frame_t {
+        buffer_t up;    // moves back up over the previous frame
+        buffer_t delta;
+        buffer_t full;  // null if nobody in the group needed one
+    };
+
+    struct client_t {
+        int fd = -1;
+        hello_t hello;
+        bool greeted = false;
+        bool fresh = true;      // nothing from its group on screen yet
+        bool resync = false;    // frames were dropped, the next one has to be full
+        uint64_t group = 0;     // assigned by the stream, 0 for none
+        unsigned dropped = 0;
+
+      private:
+        friend class FanoutServer;
+        struct entry_t {
+            buffer_t parts[2];
+            unsigned count = 0;
+        };
+        std::deque<entry_t> queue;
+        size_t sent = 0;        // bytes of the front entry already written
+        size_t helloBytes = 0;  // of a hello still coming in
+        char in[sizeof(hello_t)];
+        bool gone = false;
+    };
+
+  private:
+    int listener = -1;
+    std::string path;
+    std::vector<std::unique_ptr<client_t>> clients;
+    std::vector<struct pollfd> fds;
+    buffer_t clear = std::make_shared<const std::string>("\x1B[2J\x1B[H");
+
+    // Writes as much of the queue as the socket takes without blocking
+    void send(client_t& c) {
+        while(!c.queue.empty()) {
+            auto& e = c.queue.front();
+            struct iovec v[2];
+            size_t skip = c.sent;
+            unsigned n = 0;
+            for(unsigned i = 0; i < e.count; ++i) {
+                size_t size = e.parts[i]->size();
+                if(skip >= size) {
+                    skip -= size;
+                    continue;
+                }
+                v[n++] = {(void*)(e.parts[i]->data() + skip), size - skip};
+                skip = 0;
+            }
+            struct msghdr m = {};
+            m.msg_iov = v;
+            m.msg_iovlen = n;
+            ssize_t w = n ? sendmsg(c.fd, &m, MSG_NOSIGNAL | MSG_DONTWAIT) : 0;
+            if(w < 0) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    c.gone = true;
+                return;
+            }
+            c.sent += w;
+            size_t total = 0;
+            for(unsigned i = 0; i < e.count; ++i)
+                total += e.parts[i]->size();
+            if(c.sent < total)
+                return;
+            c.queue.pop_front();
+            c.sent = 0;
+        }
+    }
+
+    // Takes in whatever part of a hello has arrived
+    void receive(client_t& c) {
+        for(;;) {
+            ssize_t r = read(c.fd, c.in + c.helloBytes, sizeof(hello_t) - c.helloBytes);
+            if(r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                c.gone = true;
+                return;
+            }
+            if(r < 0)
+                return;
+            c.helloBytes += r;
+            if(c.helloBytes < sizeof(hello_t))
+                continue;
+            c.helloBytes = 0;
+            hello_t h;
+            memcpy(&h, c.in, sizeof(h));
+            if(memcmp(h.magic, SERVE_MAGIC, sizeof(SERVE_MAGIC))) {
+                c.gone = true;
+                return;
+            }
+            c.hello = h;
+            c.greeted = true;
+            c.group = 0; // the stream finds it a group again
+        }
+    }
+
+    // Empties the queue but for a frame part way out, which has to be finished
+    static void cut(client_t& c) {
+        if(c.queue.empty())
+            return;
+        size_t keep = c.sent ? 1 : 0;
+        c.dropped += c.queue.size() - keep;
+        c.queue.erase(c.queue.begin() + keep, c.queue.end());
+    }
+
+  public:
+    ~FanoutServer(void) {
+        close();
+    }
+
+    // Listens on `socketPath`, replacing a stale socket. Returns false with errno set on failure.
+    bool open(std::string const& socketPath) {
+        struct sockaddr_un addr = {};
+        if(socketPath.size() >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        struct stat st;
+        if(lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(socketPath.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(listener < 0)
+            return false;
+        if(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0) {
+            int e = errno;
+            ::close(listener);
+            listener = -1;
+            errno = e;
+            return false;
+        }
+        path = socketPath;
+        return true;
+    }
+
+    bool isOpen(void) const { return listener >= 0; }
+
+    void close(void) {
+        for(auto& c : clients)
+            ::close(c->fd);
+        clients.clear();
+        if(listener >= 0) {
+            ::close(listener);
+            unlink(path.c_str());
+            listener = -1;
+        }
+    }
+
+    /* Accepts viewers, reads their hellos and writes out what they can
+     * take, for up to `timeoutMs` (0 just does what is ready). Returns the
+     * number of viewers that went away.
+     */
+    unsigned poll(int timeoutMs) {
+        fds.clear();
+        fds.push_back({listener, POLLIN, 0});
+        for(auto& c : clients)
+            fds.push_back({c->fd, (short)(POLLIN | (c->queue.empty() ? 0 : POLLOUT)), 0});
+        if(::poll(fds.data(), fds.size(), timeoutMs) > 0) {
+            for(size_t i = 1; i < fds.size(); ++i) {
+                client_t& c = *clients[i - 1];
+                if(fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                    c.gone = true;
+                if(fds[i].revents & POLLIN)
+                    receive(c);
+                if(fds[i].revents & POLLOUT)
+                    send(c);
+            }
+            if(fds[0].revents & POLLIN) {
+                int fd;
+                while((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    clients.emplace_back(new client_t);
+                    clients.back()->fd = fd;
+                }
+            }
+        }
+        auto end = std::remove_if(clients.begin(), clients.end(), [](std::unique_ptr<client_t> const& c) {
+            if(c->gone)
+                ::close(c->fd);
+            return c->gone;
+        });
+        unsigned left = clients.end() - end;
+        clients.erase(end, clients.end());
+        return left;
+    }
+
+    std::vector<std::unique_ptr<client_t>>& viewers(void) { return clients; }
+
+    // Moves a viewer to another group; its screen is cleared before the first frame from there
+    void regroup(client_t& c, uint64_t group) {
+        cut(c);
+        c.group = group;
+        c.queue.push_back({{clear}, 1});
+        c.fresh = true;
+        c.resync = false;
+    }
+
+    // True if the viewer's next frame has to be a full repaint
+    static bool needsFull(client_t const& c) {
+        return c.fresh || c.resync || c.queue.size() >= SERVE_QUEUE_FRAMES;
+    }
+
+    // Queues a frame for a viewer and starts writing it
+    void publish(client_t& c, frame_t const& f) {
+        if(c.queue.size() >= SERVE_QUEUE_FRAMES) {
+            cut(c);
+            c.resync = true;
+        }
+        client_t::entry_t e;
+        if(c.fresh)
+            e.parts[e.count++] = f.full;
+        else if(c.resync)
+            e = {{f.up, f.full}, 2};
+        else
+            e = {{f.up, f.delta}, 2};
+        c.fresh = c.resync = false;
+        c.queue.push_back(e);
+        send(c);
+    }
+};
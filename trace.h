@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Binary event tracer.
+ *
+ * Each thread records fixed size events (span begin/end and instants, with
+ * a frame number and a value such as a byte count) into its own ring of
+ * TRACE_EVENTS, overwriting the oldest. Recording takes no lock and formats
+ * nothing; with tracing off it is a single branch.
+ *
+ * Rings are exported as Chrome trace event JSON (chrome://tracing, Perfetto)
+ * and summarized as per stage latency histograms. Export may run while the
+ * other threads keep recording: events that might have been overwritten
+ * during the copy are left out.
+ */
+
+enum trace_stage_t : uint8_t {
+    TRACE_DECODE, TRACE_SCALE, TRACE_ENCODE, TRACE_WAIT, TRACE_WRITE, TRACE_DROP, TRACE_MISS, TRACE_STAGES
+};
+
+static const char* const trace_stage_names[TRACE_STAGES] = {
+    "decode", "scale", "encode", "wait", "write", "drop", "miss"
+};
+
+class Tracer {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  private:
+    struct event_t {
+        uint64_t ns;    // since the tracer started
+        uint32_t frame;
+        uint32_t value;
+        trace_stage_t stage;
+        char phase;     // 'B'egin, 'E'nd or 'i'nstant
+    };
+    static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0, "TRACE_EVENTS must be a power of two");
+
+    struct ring_t {
+        std::vector<event_t> events = std::vector<event_t>(TRACE_EVENTS);
+        std::atomic<uint64_t> head{0};
+        std::string name;
+        unsigned id = 0;
+        bool free = false;
+    };
+
+    /* Rings outlive their threads and are handed to the next thread that
+     * starts tracing, so looping playback doesn't keep adding rings.
+     */
+    struct handle_t {
+        ring_t* ring = nullptr;
+        ~handle_t(void) {
+            if(ring)
+                tracer().release(ring);
+        }
+    };
+
+    clock::time_point origin = clock::now();
+    std::mutex mutex; // guards `rings`, never taken while recording
+    std::vector<std::unique_ptr<ring_t>> rings;
+
+    ring_t* acquire(const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto& r : rings) {
+            if(r->free) {
+                r->free = false;
+                r->name = name;
+                return r.get();
+            }
+        }
+        rings.emplace_back(new ring_t);
+        rings.back()->name = name;
+        rings.back()->id = rings.size();
+        return rings.back().get();
+    }
+    void release(ring_t* r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        r->free = true;
+    }
+
+    static handle_t& local(void) {
+        thread_local handle_t handle;
+        return handle;
+    }
+
+    void record(trace_stage_t stage, char phase, uint32_t frame, uint32_t value) {
+        handle_t& h = local();
+        if(!h.ring)
+            h.ring = acquire("thread");
+        ring_t& r = *h.ring;
+        uint64_t i = r.head.load(std::memory_order_relaxed);
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - origin).count();
+        r.events[i & (TRACE_EVENTS - 1)] = {ns, frame, value, stage, phase};
+        r.head.store(i + 1, std::memory_order_release);
+    }
+
+    // Copies out the events of a ring that are certain not to have been overwritten
+    static void snapshot(ring_t const& r, std::vector<event_t>& out) {
+        out.clear();
+        uint64_t end = r.head.load(std::memory_order_acquire);
+        uint64_t begin = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+        for(uint64_t i = begin; i < end; ++i)
+            out.push_back(r.events[i & (TRACE_EVENTS - 1)]);
+        // the writer may be part way through the slot after `now`
+        uint64_t now = r.head.load(std::memory_order_acquire);
+        if(now + 1 > begin + TRACE_EVENTS)
+            out.erase(out.begin(), out.begin() + std::min<uint64_t>(out.size(), now + 1 - TRACE_EVENTS - begin));
+    }
+
+  public:
+    bool enabled = false; // set before any thread starts recording
+
+    static Tracer& tracer(void) {
+        static Tracer t;
+        return t;
+    }
+
+    // Names the calling thread in exported traces
+    void thread(const char* name) {
+        if(!enabled)
+            return;
+        handle_t& h = local();
+        if(!h.ring)
+            h.ring = acquire(name);
+        std::lock_guard<std::mutex> lock(mutex);
+        h.ring->name = name;
+    }
+
+    void begin(trace_stage_t stage, uint32_t frame, uint32_t value = 0) {
+        if(enabled)
+            record(stage, 'B', frame, value);
+    }
+    void end(trace_stage_t stage, uint32_t frame, uint32_t value = 0) {
+        if(enabled)
+            record(stage, 'E', frame, value);
+    }
+    void instant(trace_stage_t stage, uint32_t frame, uint32_t value = 0) {
+        if(enabled)
+            record(stage, 'i', frame, value);
+    }
+
+    // Writes every ring as Chrome trace event JSON. Returns false if the file couldn't be written.
+    bool exportChrome(std::string const& path) {
+        FILE* f = fopen(path.c_str(), "w");
+        if(!f)
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<event_t> events;
+        const char* sep = "";
+        fputs("{\"traceEvents\":[\n", f);
+        for(auto& r : rings) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    sep, r->id, r->name.c_str());
+            sep = ",\n";
+            snapshot(*r, events);
+            for(auto const& e : events)
+                fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+                        "\"args\":{\"frame\":%u,\"value\":%u}}", sep, trace_stage_names[e.stage], e.phase,
+                        e.phase == 'i' ? "\"s\":\"t\"," : "", e.ns / 1000.0, r->id, e.frame, e.value);
+        }
+        fputs("\n]}\n", f);
+        return fclose(f) == 0;
+    }
+
+    /* Span latencies per stage: count, percentiles and a histogram with a
+     * bucket per power of two microseconds. One line per stage with spans.
+     */
+    std::vector<std::string> histograms(void) {
+        std::vector<uint64_t> spans[TRACE_STAGES];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<event_t> events;
+            for(auto& r : rings) {
+                uint64_t open[TRACE_STAGES];
+                std::fill(open, open + TRACE_STAGES, UINT64_MAX);
+                snapshot(*r, events);
+                for(auto const& e : events) {
+                    if(e.phase == 'B') {
+                        open[e.stage] = e.ns;
+                    } else if(e.phase == 'E' && open[e.stage] != UINT64_MAX) {
+                        spans[e.stage].push_back(e.ns - open[e.stage]);
+                        open[e.stage] = UINT64_MAX;
+                    }
+                }
+            }
+        }
+
+        std::vector<std::string> lines;
+        for(unsigned s = 0; s < TRACE_STAGES; ++s) {
+            auto& d = spans[s];
+            if(d.empty())
+                continue;
+            std::sort(d.begin(), d.end());
+            auto us = [&](double q) { return d[std::min<size_t>(d.size() - 1, q * d.size())] / 1000.0; };
+            char buf[160];
+            snprintf(buf, sizeof(buf), "%s: %zu spans, p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us |",
+                    trace_stage_names[s], d.size(), us(.5), us(.9), us(.99), d.back() / 1000.0);
+            std::string line = buf;
+            unsigned buckets[33] = {0};
+            for(uint64_t ns : d) {
+                uint64_t u = ns / 1000;
+                buckets[std::min(32, u ? 64 - __builtin_clzll(u) : 0)]++;
+            }
+            for(unsigned b = 0; b < 33; ++b) {
+                if(!buckets[b])
+                    continue;
+                snprintf(buf, sizeof(buf), " <%lluus: %u", 1ull << b, buckets[b]);
+                line += buf;
+            }
+            lines.push_back(line);
+        }
+        return lines;
+    }
+};
+
+static Tracer& tracer = Tracer::tracer();
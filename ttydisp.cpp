@@ -1,6 +1,7 @@
 #include <iostream>
 #include <functional>
 #include <unordered_map>
+#include <map>
 #include <fstream>
 #include <string>
 #include <vector>
@@ -9,6 +10,10 @@
 #include <csignal>
 
 #include "colors.h"
+#include "conf.h"
+#include "quantize.h"
+#include "dither.h"
+#include "encoder.h"
 
 #ifndef AV_ERROR_MAX_STRING_SIZE
 #define AV_ERROR_MAX_STRING_SIZE 64
@@ -20,27 +25,42 @@ extern "C"
 {
 #include "libavcodec/avcodec.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+#include "libavutil/pixdesc.h"
 #include "libavformat/avformat.h"
 #include "libswscale/swscale.h"
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <unistd.h>
 #include "termios.h"
 }
 
-#include "conf.h"
-
 #include "logger.h"
+#include "yuv.h"
+#include "scaler.h"
+#include "boxscale.h"
+#include "ring.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "record.h"
+#include "archive.h"
+#include "controls.h"
+#include "loopcache.h"
+#include "server.h"
+#include "input.h"
+#include "adapt.h"
 std::ofstream of(LOG_FILENAME, std::ofstream::out);
 static Logger logger(of);
 
-static bool stop = false;
+static std::atomic<bool> stop{false};
+static std::atomic<bool> resized{true}; // set by SIGWINCH
+static std::atomic<bool> traceRequested{false}; // set by SIGUSR1
 
 static const bool istty = isatty(fileno(stdout));
 
-#define COLOR_TEXT_FORMAT "\x1B[48;05;%um\x1B[38;05;%um%c"
-#define COLOR_FORMAT "\x1B[48;05;%um "
-#define COLOR_RESET "\x1B[0m"
+static const quantize_isa_t quantize_isa = detect_quantize_isa();
 
 typedef struct {
     std::string filename;
@@ -51,29 +71,194 @@ typedef struct {
     uint8_t pad = 0;
     uint16_t fps = 0;
     bool accurate_colors = true;
+    bool delta = true;
+    bool half_blocks = false;
+    color_mode_t color_mode = COLOR_256;
+    bool detect_color_mode = true; // from $COLORTERM unless -c is given
+    unsigned truecolor_bits = TRUECOLOR_BITS;
+    dither_t dither = DITHER_NONE;
+    bool yuv = true; // quantize YUV sources without going through RGB
+    scale_mode_t scaling = SCALE_BICUBIC;
+    int lowres = 0;
+    unsigned lut_bits = COLOR_LUT_BITS;
+    int decoder_threads = 0; // 0 lets the decoder decide
+    int decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    unsigned render_threads = 1;
+    std::string trace_file; // empty leaves tracing off
+    std::string record_file; // empty shows frames on stdout
+    std::string archive_file; // -compile target
+    unsigned loop_cache_mb = LOOP_CACHE_MB;
+    std::string serve_socket; // -serve: render for viewers on this socket
+    std::string connect_socket; // -connect: be a viewer of a server
+    bool mosaic = false;
+    std::vector<std::string> mosaic_files; // the inputs after the first
+    bool adapt = true; // step quality down while the terminal can't keep up
+    unsigned budget_kib = 0; // -bw, KiB/s for adaptive quality to stay under, 0 for none
 } config_t;
 
 static config_t config;
 
+// Writes out the trace and logs per stage latencies, also to `also` if given
+static void write_trace(std::ostream* also = nullptr) {
+    if(!tracer.exportChrome(config.trace_file))
+        logger.log("Error writing trace to `" + config.trace_file + "'");
+    for(auto const& line : tracer.histograms()) {
+        logger.log(line);
+        if(also)
+            *also << line << '\n';
+    }
+}
+
+/* Only asks the terminal again after a SIGWINCH. Every thread that shows
+ * frames calls it, so whichever takes the flag updates the size for all.
+ */
 std::pair<unsigned/*width*/, unsigned/*height*/> getTTYDimensions(void) {
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    return {w.ws_col, w.ws_row};
+    static std::mutex mutex;
+    static std::pair<unsigned, unsigned> size;
+    std::lock_guard<std::mutex> lock(mutex);
+    if(resized.exchange(false)) {
+        struct winsize w = {};
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+        size = {w.ws_col, w.ws_row};
+    }
+    return size;
 }
 
 /* ffmpeg abstraction */
 class Stream {
   private:
+    Input input; // outlives the format context, which may read through it
     struct av {
         AVCodec *codec = nullptr;
         AVCodecContext *codecContext = nullptr;
         AVFormatContext *formatContext = nullptr;
         AVDictionary *dict = nullptr;
-        struct SwsContext *swsContext = nullptr;
         int videoStreamIndex = -1;
     } av;
     unsigned frameNum = 0;
+    unsigned decodedFrames = 0; // numbers frames through the pipeline for traces
+    unsigned missedFrames = 0;
     uint8_t pad = 0;
+    /* What turns decoded frames into cells in one colour mode, keeping
+     * whatever it built for the last size. Playback has one; a server has
+     * one per group of clients.
+     */
+    struct view_t {
+        color_mode_t colorMode = COLOR_256;
+        quantize_row_fn quantizeRow = nullptr;
+        ErrorDiffusion diffusion;
+        BoxScaler box{quantize_isa};
+        Scaler scaler{1};
+        unsigned scalerRebuilds = 0;
+
+        void use(color_mode_t mode) {
+            colorMode = mode;
+            quantizeRow = mode == COLOR_TRUE ? quantize_row_truecolor
+                : select_quantize_row(config.accurate_colors, quantize_isa, config.pad);
+            diffusion.use(config.accurate_colors, config.pad);
+        }
+    } view;
+    YuvLUT yuvLut;
+    YuvToRgb yuvToRgb;
+    quantize_yuv_row_fn quantizeYuvRow = nullptr;
+    FrameEncoder encoder;
+    ThreadPool pool;
+    Scheduler scheduler;
+    int skipLevel = 0; // what the decoder was last told to skip
+    /* Transport controls: the input thread posts seeks, the decode thread
+     * carries them out and moves on to a new epoch, and the later stages
+     * throw away whatever is left over from an older one.
+     */
+    KeyframeIndex keyframes;
+    std::atomic<unsigned> epoch{0};
+    std::atomic<bool> seekPending{false};
+    std::mutex seekMutex;
+    double seekTarget = 0;           // guarded by seekMutex
+    clk::time_point seekRequested;   // guarded by seekMutex
+    double catchUp = -1;             // decode thread: frames before this aren't shown
+    std::atomic<bool> paused{false};
+    std::atomic<double> position{0}; // stream time of the last frame shown
+
+    Recorder recorder;
+    ArchiveWriter archive;
+    std::string recorded; // the frame being recorded, archived or cached
+    LoopCache loopCache;
+    /* Adaptive quality: the output thread measures writes and picks the
+     * step, the scale thread follows it.
+     */
+    QualityController adapt;
+    unsigned qualityStep = 0;   // scale thread: the step the view is set up for
+    unsigned rateCount = 0;     // scale thread: frames since the last one shown
+    unsigned shownWidth = 0, shownLines = 0; // the grid on screen
+    unsigned droppedSeen = 0;   // output thread: late frames already told to the controller
+
+    /* Playback is a three stage pipeline: the decode thread fills `decoded`,
+     * the scale thread turns those into cell grids in `quantized`, and the
+     * thread that called display() encodes and writes them. A slot with
+     * `end` set marks the end of the stream.
+     */
+    struct decoded_t {
+        AVFrame* frame = nullptr;
+        unsigned seq = 0;
+        unsigned epoch = 0;
+        bool end = false;
+    };
+    struct cells_t {
+        std::vector<uint32_t> cells;
+        unsigned width = 0, height = 0;
+        clk::time_point due; // before Scheduler::shifted()
+        double pts = 0;
+        double position = 0; // stream time, which -f doesn't change
+        color_mode_t colorMode = COLOR_256;
+        unsigned seq = 0;
+        unsigned epoch = 0;
+        bool end = false;
+    };
+    SpscRing<decoded_t> decoded{PIPELINE_DEPTH};
+    SpscRing<cells_t> quantized{PIPELINE_DEPTH};
+    std::atomic<bool> halt{false};
+    std::atomic<bool> failed{false};
+
+    /* Server mode: viewers with the same grid size and colour mode share
+     * a group, which renders and encodes each frame once for all of them.
+     */
+    struct group_t {
+        unsigned width, height;
+        view_t view;
+        FrameEncoder encoder, full;
+        cells_t cells;
+        FanoutServer::frame_t frame; // the next one to hand out
+    };
+    FanoutServer server;
+    std::map<uint64_t, std::unique_ptr<group_t>> groups;
+
+    // Mosaic: the tile's cells, width << 32 | height, or 0 when not in a mosaic
+    std::atomic<uint64_t> tile{0};
+    std::thread decodeThread, scaleThread;
+    bool ended = false;
+
+    // Recording or compiling an archive instead of showing frames
+    bool offline(void) const {
+        return recorder.isOpen() || archive.isOpen();
+    }
+    bool serving(void) const {
+        return server.isOpen();
+    }
+    // Frames are paced and may be dropped only when shown on a terminal
+    bool realtime(void) const {
+        return istty && !offline() && !serving();
+    }
+    // The verbose status line under the frame
+    bool statusLine(void) const {
+        return config.verbose && !offline() && !serving();
+    }
+    bool halted(void) const {
+        return halt.load(std::memory_order_relaxed) || stop.load(std::memory_order_relaxed);
+    }
+    void fail(void) {
+        failed = true;
+        halt = true;
+    }
   protected:
     double wait_time() {
         if(!av.codecContext) return 0;
@@ -83,92 +268,909 @@ class Stream {
         AVRational r = av.codecContext->time_base;
         return av_q2d(r) * std::max(av.codecContext->ticks_per_frame, 1);
     }
-    unsigned char generateANSIColor(uint8_t r, uint8_t g, uint8_t b, uint8_t pad) {
-        if(config.accurate_colors)
-            return get_closest_color((r << 16) + (g << 8) + b);
-
-        r = r >= pad ? r - pad : 0;
-        g = g >= pad ? g - pad : 0;
-        b = b >= pad ? b - pad : 0;
-        float t = (r + g + b)/3.0; // 24 grayscale colors
-        uint8_t g_rawlum = lround(t * 23.0/255);
-        uint8_t r_rawval = lround(r * 5.0/255);
-        uint8_t g_rawval = lround(g * 5.0/255);
-        uint8_t b_rawval = lround(b * 5.0/255);
-
-        float g_lum = g_rawlum * 255/23.0;
-        float r_val = r_rawval * 255/5.0;
-        float g_val = g_rawval * 255/5.0;
-        float b_val = b_rawval * 255/5.0;
-
-        float g_score = fabs(r - g_lum) + fabs(g - g_lum) + fabs(b - g_lum);
-        float c_score = fabs(r - r_val) + fabs(g - g_val) + fabs(b - b_val);
-
-        if(c_score < g_score + COLOR_BIAS) {
-            return 16 + (36 * r_rawval) + (6 * g_rawval) + b_rawval;
-        } else {
-            return 232 + g_rawlum;
+    // Seconds into the stream; -f or a missing timestamp counts frames instead
+    double presentationTime(const AVFrame* frame) {
+        if(config.fps == 0 && frame->best_effort_timestamp != AV_NOPTS_VALUE)
+            return frame->best_effort_timestamp * av_q2d(av.formatContext->streams[av.videoStreamIndex]->time_base);
+        return scheduler.running() ? scheduler.previousPts() + wait_time() : 0;
+    }
+    /* Lets the decoder cut corners while playback is behind: first the loop
+     * filter on non-reference frames, then everywhere, then whole frames.
+     */
+    void applySkipLevel(bool force = false) {
+        static const AVDiscard loopFilter[] = { AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_ALL, AVDISCARD_ALL };
+        static const AVDiscard frames[] = { AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_BIDIR };
+        if(catchUp >= 0) // seek() has its own settings until the target is reached
+            return;
+        int level = scheduler.skipLevel();
+        if(level == skipLevel && !force)
+            return;
+        av.codecContext->skip_loop_filter = loopFilter[level];
+        av.codecContext->skip_frame = frames[level];
+        if(level != skipLevel)
+            logger.log("Decoder skip level " + std::to_string(skipLevel) + " -> " + std::to_string(level));
+        skipLevel = level;
+    }
+    // Scale thread: sets the view up for an adaptive quality step
+    void applyQuality(unsigned step) {
+        quality_t const& q = adapt.quality(step);
+        view.use(q.palette ? COLOR_256 : config.color_mode);
+        if(view.colorMode == COLOR_TRUE)
+            build_truecolor_levels(q.bits, config.pad);
+        qualityStep = step;
+    }
+    void logQuality(void) {
+        quality_t const& q = adapt.quality(adapt.step());
+        logger.log("Quality step " + std::to_string(adapt.step()) + " of " + std::to_string(adapt.steps() - 1) + ": "
+                + std::to_string(q.scale) + "% grid, 1 in " + std::to_string(q.rate) + " frames, "
+                + (q.palette ? std::string("256 colors") : std::to_string(q.bits) + " bit truecolor")
+                + " (" + std::to_string((int)(adapt.load() * 100)) + "% load, "
+                + std::to_string((unsigned)(adapt.throughput() / 1024)) + " KiB/s written)");
+    }
+    // Seconds of stream time at the first and last frame, false if the length isn't known
+    bool bounds(double& start, double& end) const {
+        const AVFormatContext* f = av.formatContext;
+        if(!f || f->duration == AV_NOPTS_VALUE || f->duration <= 0)
+            return false;
+        start = f->start_time == AV_NOPTS_VALUE ? 0 : f->start_time / (double)AV_TIME_BASE;
+        end = start + f->duration / (double)AV_TIME_BASE;
+        return true;
+    }
+    // Input thread: acts on a key
+    void control(command_t c) {
+        double start = 0, end = 0, target;
+        bool known = bounds(start, end);
+        switch(c.control) {
+            case CONTROL_PAUSE:
+                paused = !paused;
+                return;
+            case CONTROL_QUIT:
+                stop = true;
+                return;
+            case CONTROL_SEEK_TO:
+                if(!known) {
+                    logger.log("Can't seek to a percentage without knowing the length");
+                    return;
+                }
+                target = start + c.amount * (end - start);
+                break;
+            case CONTROL_SEEK_BY: {
+                std::lock_guard<std::mutex> lock(seekMutex);
+                // presses before the last seek landed add up
+                target = (seekPending ? seekTarget : position.load()) + c.amount;
+                break;
+            }
+            default:
+                return;
+        }
+        // stop short of the end so that there is something to show
+        if(known)
+            target = std::min(target, end - 1);
+        target = std::max(target, start);
+        std::lock_guard<std::mutex> lock(seekMutex);
+        seekTarget = target;
+        seekRequested = clk::now();
+        seekPending = true;
+    }
+    /* Decode thread: carries out the last seek posted. Lands on the keyframe
+     * before the target, from the index when that part of the file has been
+     * demuxed already, and has the decoder skip what isn't needed to get from
+     * there to the frame before the target.
+     */
+    void seek(void) {
+        double target;
+        {
+            std::lock_guard<std::mutex> lock(seekMutex);
+            target = seekTarget;
+            seekPending = false;
+        }
+        auto stream = av.formatContext->streams[av.videoStreamIndex];
+        int64_t ts = target / av_q2d(stream->time_base);
+        auto key = keyframes.before(ts);
+        int ret = av_seek_frame(av.formatContext, av.videoStreamIndex, key ? key->ts : ts, AVSEEK_FLAG_BACKWARD);
+        if(ret < 0 && key && key->pos >= 0)
+            ret = av_seek_frame(av.formatContext, av.videoStreamIndex, key->pos, AVSEEK_FLAG_BYTE);
+        if(ret < 0) {
+            logger.log("Can't seek in this input");
+            return;
+        }
+        avcodec_flush_buffers(av.codecContext);
+        keyframes.seeked();
+        epoch++;
+        catchUp = target;
+        av.codecContext->skip_frame = AVDISCARD_NONREF;
+        av.codecContext->skip_loop_filter = AVDISCARD_ALL;
+        logger.log("Seeking to " + std::to_string(target) + " s" + (key ? " (indexed keyframe)" : ""));
+    }
+    // True if a packet at `ts` is within a frame of the seek target, or can't be placed
+    bool nearTarget(int64_t ts) const {
+        auto stream = av.formatContext->streams[av.videoStreamIndex];
+        AVRational rate = stream->avg_frame_rate;
+        double frame = rate.num && rate.den ? (double)rate.den / rate.num : 0;
+        return ts == AV_NOPTS_VALUE || ts * av_q2d(stream->time_base) >= catchUp - frame;
+    }
+    // Input thread: reads keys until playback ends
+    void inputStage(void) {
+        KeyReader keys;
+        char buffer[64];
+        struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+        while(!halted()) {
+            if(poll(&in, 1, 100) <= 0)
+                continue;
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if(n <= 0)
+                return;
+            keys.feed(buffer, n, [this](command_t c) { control(c); });
         }
     }
     void resetFrame(unsigned height) {
-        for(unsigned i = 0; i < height - 1; ++i)
-            printf("\x1B[F");
-    }
-    AVFrame* convert(AVFrame* frame, unsigned width, unsigned height) {
-        // We don't use YUV because it introduces artefacts in the final image
-        // av.swsContext = sws_getCachedContext(av.swsContext, frame->width, frame->height, (AVPixelFormat)frame->format, width, height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
-        // av.swsContext = sws_getCachedContext(av.swsContext, frame->width, frame->height, (AVPixelFormat)frame->format, width, height, AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
-        av.swsContext = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, width, height, AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
-        logger.log("DONE");
-        logger.log("Scaling to dims " + std::to_string(width) + ", " + std::to_string(height));
-        AVFrame *nframe = av_frame_alloc();
-        nframe->width = width;
-        nframe->height = height;
-        // unsigned nb = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
-        unsigned nb = av_image_get_buffer_size(AV_PIX_FMT_RGB24, width, height, 1);
-        auto buffer = (uint8_t*)av_malloc(nb * sizeof(uint8_t));
-        // av_image_fill_arrays(nframe->data, nframe->linesize, buffer, AV_PIX_FMT_YUV420P, width, height, 1);
-        av_image_fill_arrays(nframe->data, nframe->linesize, buffer, AV_PIX_FMT_RGB24, width, height, 1);
-        sws_scale(av.swsContext, (uint8_t**)frame->data, frame->linesize, 0, frame->height, (uint8_t**)nframe->data, nframe->linesize);
+        encoder.cursorUp(height - 1);
+    }
+    // Writes the status line under a frame; `last` is when the frame before it was shown
+    void printStatus(clk::time_point& last, clk::time_point now, unsigned width, unsigned height, size_t bytes) {
+        auto start = last;
+        last = now;
+        std::cout << "\n file: " + config.filename + " | fps (des): " + std::to_string(1.0/wait_time())
+            + " | fps (act): " + std::to_string(1.0E9/std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count())
+            + " | height: " + std::to_string(height) + " | width: " + std::to_string(width)
+            + " | bytes: " + std::to_string(bytes)
+            + (adapt.active() ? " | quality: " + std::to_string(adapt.step()) : std::string())
+            + " | dropped: " + std::to_string(scheduler.droppedFrames()) + "   ";
+    }
+    // Writes a frame kept without the move back up to the previous one, `lines` tall with the status line
+    int writeFrame(std::string const& data, unsigned width, unsigned lines) {
+        const bool regrid = frameNum && shownLines && (width != shownWidth || lines != shownLines);
+        const unsigned from = regrid ? shownLines : lines;
+        char up[24];
+        int n = frameNum && from > 1 ? snprintf(up, sizeof(up), "\x1B[%uF", from - 1) : 0;
+        if(regrid)
+            n += snprintf(up + n, sizeof(up) - n, "\x1B[J");
+        fflush(stdout); // the status line goes first
+        struct iovec v[2] = {{up, (size_t)n}, {(void*)data.data(), data.size()}};
+        return write_all(STDOUT_FILENO, v, 2);
+    }
+    /* Plays a pass from the loop cache. Returns false, with the rest of
+     * the pass left to decoding, if a seek is asked for, the terminal
+     * changes size or adaptive quality steps down. Quality isn't measured
+     * when the input can't be rewound, since nothing could be decoded to
+     * replace the cache, and a resize leaves the cache playing at the size
+     * it was filled at. Cached frames are deltas, so late ones are still
+     * shown.
+     */
+    bool replay(void) {
+        std::thread inputThread;
+        if(realtime() && isatty(STDIN_FILENO))
+            inputThread = std::thread(&Stream::inputStage, this);
+        const bool fixed = config.width >= 0 && config.height >= 0;
+        auto last = clk::now();
+        unsigned shown = 0;
+        // a pipe has nothing to decode another pass from
+        const bool rewinds = input.type() != INPUT_PIPE;
+        bool done = true, stepped = false;
+        if(adapt.active())
+            adapt.restart(last);
+        for(size_t i = 0; i < loopCache.size() && !halted(); ++i) {
+            if(paused) {
+                auto since = clk::now();
+                while(paused && !halted() && !seekPending)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                scheduler.shift(clk::now() - since);
+                if(adapt.active())
+                    adapt.restart(clk::now());
+            }
+            if(seekPending) {
+                done = false;
+                break;
+            }
+            const bool resized = !fixed && getTTYDimensions() != loopCache.tty;
+            if(resized && !rewinds) {
+                logger.log("Terminal resized, but the input can't be rewound, so the loop cache plays on at its own size");
+                loopCache.tty = getTTYDimensions();
+            }
+            const char* leave = stepped ? "Quality changed" : resized && rewinds ? "Terminal resized" : nullptr;
+            if(leave) {
+                logger.log(std::string(leave) + ", dropping the loop cache");
+                loopCache.drop();
+                // carry on decoding from here
+                std::lock_guard<std::mutex> lock(seekMutex);
+                seekTarget = position;
+                seekRequested = clk::now();
+                seekPending = true;
+                done = false;
+                break;
+            }
+            auto const& f = loopCache[i];
+            auto due = scheduler.shifted(scheduler.deadline(f.pts));
+            if(realtime())
+                Scheduler::sleepUntil(due);
+            auto writing = clk::now();
+            tracer.begin(TRACE_WRITE, i);
+            const unsigned lines = f.height + (statusLine() ? 1 : 0);
+            if(writeFrame(f.data, f.width, lines) < 0) {
+                logger.log(std::string("Error writing frame: ") + strerror(errno));
+                fail();
+                break;
+            }
+            tracer.end(TRACE_WRITE, i, f.data.size());
+            shownWidth = f.width;
+            shownLines = lines;
+            position = f.position;
+            frameNum++;
+            shown++;
+            auto n = clk::now();
+            if(adapt.active() && rewinds
+                    && adapt.wrote(f.data.size(), std::chrono::duration<double>(n - writing).count(), 0, false, n)) {
+                logQuality();
+                stepped = true;
+            }
+            if(realtime() && Scheduler::late(due, n))
+                missedFrames++;
+            if(statusLine())
+                printStatus(last, n, f.width, f.height, f.data.size());
+            if(traceRequested.exchange(false))
+                write_trace();
+        }
+        halt = true;
+        if(inputThread.joinable())
+            inputThread.join();
+        logger.log("Played " + std::to_string(shown) + " frames from the loop cache");
+        if(!done)
+            encoder.invalidate(); // it last saw the end of the clip, not what is on screen
+        return done;
+    }
+    // Dithering and truecolor work on RGB, so only plain palette output can skip it
+    bool quantizeFromYuv(view_t const& v, const AVFrame* frame) const {
+        return config.yuv && v.colorMode == COLOR_256 && config.dither == DITHER_NONE && yuv_source(frame->format);
+    }
+    void prepareYuvLut(const AVFrame* frame) {
+        AVColorSpace matrix = yuv_matrix(frame);
+        bool full = yuv_full_range(frame);
+        auto start = clk::now();
+        if(yuvLut.build(YUV_LUT_BITS, matrix, full, config.accurate_colors, pad))
+            logger.log(std::string("Quantizing from YUV (") + yuv_matrix_name(matrix) + ", "
+                    + (full ? "full" : "limited") + " range), table built in " + std::to_string(
+                        std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - start).count()) + " ms");
+    }
+    AVFrame* convert(view_t& v, AVFrame* frame, unsigned width, unsigned height) {
+        AVPixelFormat format = AV_PIX_FMT_RGB24;
+        if(quantizeFromYuv(v, frame)) {
+            format = AV_PIX_FMT_YUV444P;
+            prepareYuvLut(frame);
+        }
+        AVFrame* nframe = v.scaler.scale(frame, width, height, format);
+        if(v.scaler.rebuildCount() != v.scalerRebuilds) {
+            v.scalerRebuilds = v.scaler.rebuildCount();
+            logger.log("Scaling to dims " + std::to_string(width) + ", " + std::to_string(height));
+        }
         return nframe;
     }
-    void render(AVFrame* frame) {
-        unsigned x, y;
-        unsigned height = frame->height;
+    /* Where a row's pixels come from: RGB24, or YUV turned into RGB or
+     * straight into cells through the YUV table.
+     */
+    enum source_t { SOURCE_RGB, SOURCE_YUV_RGB, SOURCE_YUV };
+    typedef void (Stream::*rows_fn)(view_t const&, const AVFrame*, uint32_t*, unsigned, unsigned, unsigned);
+    /* Quantizes pixel rows [y0, y1) of a scaled frame, or of the box
+     * averages of a decoded one. There is one instantiation for every way
+     * a row can go, so nothing in the loop depends on the frame or on config.
+     */
+    template<bool Box, source_t Source, bool Ordered>
+    void quantizeRows(view_t const& v, const AVFrame* frame, uint32_t* cells, unsigned width, unsigned y0, unsigned y1) {
+        thread_local std::vector<uint8_t> rgb, yr, ur, vr, dithered;
+        rgb.resize(width * 3);
+        dithered.resize(width * 3);
+        if(Box) {
+            yr.resize(width);
+            ur.resize(width);
+            vr.resize(width);
+        }
+        for(unsigned y = y0; y < y1; ++y) {
+            uint32_t* out = cells + (size_t)y * width;
+            const uint8_t *p, *py, *pu = nullptr, *pv = nullptr;
+            if(Box) {
+                v.box.row(frame, y, rgb.data(), yr.data(), ur.data(), vr.data());
+                p = rgb.data();
+                py = yr.data();
+                pu = ur.data();
+                pv = vr.data();
+            } else {
+                p = py = frame->data[0] + y * frame->linesize[0];
+                if(Source != SOURCE_RGB) {
+                    pu = frame->data[1] + y * frame->linesize[1];
+                    pv = frame->data[2] + y * frame->linesize[2];
+                }
+            }
+            if(Source == SOURCE_YUV) {
+                quantizeYuvRow(py, pu, pv, out, width, yuvLut);
+                continue;
+            }
+            if(Source == SOURCE_YUV_RGB) {
+                yuvToRgb.row(py, pu, pv, rgb.data(), width);
+                p = rgb.data();
+            }
+            if(Ordered) {
+                dither_row_ordered(p, dithered.data(), width, y);
+                p = dithered.data();
+            }
+            v.quantizeRow(p, out, width, pad);
+        }
+    }
+    // The row kernel for a frame, picked once for all of its rows
+    template<bool Box>
+    rows_fn rowKernel(view_t const& v, source_t source) const {
+        const bool ordered = config.dither == DITHER_ORDERED && v.colorMode == COLOR_256;
+        switch(source) {
+            case SOURCE_YUV:
+                return &Stream::quantizeRows<Box, SOURCE_YUV, false>;
+            case SOURCE_YUV_RGB:
+                return ordered ? &Stream::quantizeRows<Box, SOURCE_YUV_RGB, true>
+                    : &Stream::quantizeRows<Box, SOURCE_YUV_RGB, false>;
+            default:
+                return ordered ? &Stream::quantizeRows<Box, SOURCE_RGB, true>
+                    : &Stream::quantizeRows<Box, SOURCE_RGB, false>;
+        }
+    }
+    // Runs a row kernel over the whole grid, RENDER_BAND_ROWS cell rows to a task
+    void quantizeBands(view_t const& v, const AVFrame* frame, cells_t& out, rows_fn kernel) {
+        const unsigned rows = config.half_blocks ? 2 : 1;
+        pool.parallelFor((out.height + RENDER_BAND_ROWS - 1) / RENDER_BAND_ROWS, [&](unsigned band) {
+            unsigned y1 = std::min((band + 1) * RENDER_BAND_ROWS, out.height) * rows;
+            (this->*kernel)(v, frame, out.cells.data(), out.width, band * RENDER_BAND_ROWS * rows, y1);
+        });
+    }
+    /* Box scaling: averages each pixel row of the grid straight out of the
+     * decoded frame and quantizes it, with no scaled frame in between.
+     */
+    void renderBox(view_t& v, AVFrame* frame, unsigned width, unsigned pixelHeight, cells_t& out) {
+        const unsigned rows = config.half_blocks ? 2 : 1;
+        if(v.box.prepare(frame, width, pixelHeight)) {
+            logger.log("Box scaling to dims " + std::to_string(width) + ", " + std::to_string(pixelHeight));
+            const AVPixFmtDescriptor* d = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+            if(yuv_source(frame->format) && (d->log2_chroma_w || d->log2_chroma_h))
+                logger.log("Box scaling ignores chroma siting");
+        }
+        out.cells.resize((size_t)width * pixelHeight);
+        out.width = width;
+        out.height = pixelHeight / rows;
+
+        source_t source = SOURCE_RGB;
+        if(quantizeFromYuv(v, frame)) {
+            source = SOURCE_YUV;
+            prepareYuvLut(frame);
+        } else if(yuv_source(frame->format)) {
+            source = SOURCE_YUV_RGB;
+            yuvToRgb.build(yuv_matrix(frame), yuv_full_range(frame));
+        }
+        quantizeBands(v, frame, out, rowKernel<true>(v, source));
+    }
+    // In half block mode the frame has two pixel rows per cell row
+    void render(view_t& v, AVFrame* frame, cells_t& out) {
+        const unsigned rows = config.half_blocks ? 2 : 1;
+        unsigned height = frame->height / rows;
         unsigned width = frame->width;
-        // std::cout << width <<' ' << height << std::endl;;
-        // return;
-        for(y = 0; y < height; ++y) {
-            for(x = 0; x < width; ++x) {
-                /*
-                // YUV
-                uint8_t Y = frame->data[0][y * frame->linesize[0] + x];
-                uint8_t U = frame->data[1][y/2 * frame->linesize[1] + x/2];
-                uint8_t V = frame->data[2][y/2 * frame->linesize[2] + x/2];
-
-                // RGB conversion
-                const uint8_t r = Y + 1.402*(V-128);
-                const uint8_t g = Y - 0.344*(U-128) - 0.714*(V-128);
-                const uint8_t b = Y + 1.772*(U-128);
-                */
-                const uint8_t r = frame->data[0][0 + 3 * (x + y * width)];
-                const uint8_t g = frame->data[0][1 + 3 * (x + y * width)];
-                const uint8_t b = frame->data[0][2 + 3 * (x + y * width)];
-
-                auto ansiColor = generateANSIColor(r, g, b, pad);
-
-                printf(COLOR_FORMAT, ansiColor);
-                // printf(COLOR_TEXT_FORMAT, ansiColor, 0, ansiColor >= 232 ? 'g' : 'c');
-                // printf("%d %d %d (%d %d %d)\n", x, y, ansiColor, r, g, b);
-            }
-            printf(COLOR_RESET);
-
-            if(y < height - 1) {
-                printf("\n");
+        out.cells.resize((size_t)width * height * rows);
+        out.width = width;
+        out.height = height;
+        if(config.dither == DITHER_FS && v.colorMode == COLOR_256) {
+            v.diffusion.begin(width);
+            for(unsigned y = 0; y < height * rows; ++y)
+                v.diffusion.row(frame->data[0] + y * frame->linesize[0], out.cells.data() + (size_t)y * width, width);
+            return;
+        }
+        quantizeBands(v, frame, out, rowKernel<false>(v, frame->format == AV_PIX_FMT_YUV444P ? SOURCE_YUV : SOURCE_RGB));
+    }
+    // Scales and quantizes a decoded frame. Returns false if it can't be scaled.
+    bool renderFrame(view_t& v, AVFrame* frame, unsigned width, unsigned pixelHeight, cells_t& out) {
+        // error diffusion runs over whole scaled frames, so it keeps to swscale
+        if(config.scaling == SCALE_BOX && config.dither != DITHER_FS
+                && BoxScaler::supports(frame, width, pixelHeight)) {
+            renderBox(v, frame, width, pixelHeight, out);
+            return true;
+        }
+        auto nf = convert(v, frame, width, pixelHeight);
+        if(!nf) {
+            logger.log("Error creating scaling context");
+            return false;
+        }
+        render(v, nf, out);
+        return true;
+    }
+    bool targetDimensions(const AVFrame* frame, unsigned& w, unsigned& h) {
+        if(uint64_t box = tile) { // fills a mosaic tile, whatever -w and -h say
+            if(!fitDimensions(frame, box >> 32, box & UINT32_MAX, w, h, false)) {
+                std::cerr << "Got invalid dimensions" << std::endl;
+                return false;
+            }
+            return true;
+        }
+        auto [ tty_width, tty_height ] = getTTYDimensions();
+        if(statusLine())
+            tty_height -= 1;
+        if(!fitDimensions(frame, tty_width, tty_height, w, h)) {
+            std::cerr << "Got invalid dimensions" << std::endl;
+            return false;
+        }
+        return true;
+    }
+    // The grid size for a frame on a terminal of `tty_width` by `tty_height`, limited by -w and -h if `limits`
+    bool fitDimensions(const AVFrame* frame, unsigned tty_width, unsigned tty_height, unsigned& w, unsigned& h,
+            bool limits = true) const {
+        const int fixedWidth = limits ? config.width : -1, fixedHeight = limits ? config.height : -1;
+        auto height = fixedHeight < 0 ? tty_height : fixedHeight;
+        auto width  = fixedWidth  < 0 ? tty_width  : fixedWidth;
+        float aspect = (float)(frame->height)/frame->width * PIXEL_ASPECT_RATIO;
+        if(fixedHeight < 0 && fixedWidth < 0) {
+            if((unsigned)round(aspect * width) > height) {
+                // width is too great
+                width = (unsigned)(height/aspect);
             } else {
-                printf("\x1B[m");
-                fflush(stdout);
+                // height is too great
+                height = (unsigned)(aspect * width);
             }
+        } else {
+            if(fixedHeight >= 0)
+                if(fixedWidth < 0)
+                    width = (unsigned)(height/aspect);
+            if(fixedHeight < 0)
+                if(fixedWidth >= 0)
+                    height = (unsigned)(width*aspect);
+        }
+
+        if(height <= 0 || width <= 0)
+            return false;
+        w = width;
+        h = height;
+        return true;
+    }
+    /* Hands every frame the decoder has ready to the scale stage. Frame
+     * threaded decoders hold several frames back and then return them in a
+     * burst, so this always drains until the decoder asks for more input.
+     * Returns false on a decoder error or when the pipeline halts, and
+     * returns early when a seek is posted.
+     */
+    bool receiveFrames(AVFrame* frame) {
+        for(;;) {
+            int ret = avcodec_receive_frame(av.codecContext, frame);
+            if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                return true;
+            if(ret < 0) {
+                char error[AV_ERROR_MAX_STRING_SIZE];
+                av_strerror(ret, error, AV_ERROR_MAX_STRING_SIZE);
+                logger.log(std::string("Error decoding frame: ") + error);
+                fail();
+                return false;
+            }
+
+            if(catchUp >= 0) {
+                auto ts = frame->best_effort_timestamp;
+                if(ts != AV_NOPTS_VALUE
+                        && ts * av_q2d(av.formatContext->streams[av.videoStreamIndex]->time_base) < catchUp) {
+                    av_frame_unref(frame);
+                    continue;
+                }
+                catchUp = -1;
+                applySkipLevel(true);
+            }
+
+            // a seek throws away whatever the decoder still holds
+            auto slot = ring_wait([this]{ return decoded.writeSlot(); }, [this]{ return halted() || seekPending; });
+            if(!slot)
+                return !halted();
+            av_frame_unref(slot->frame);
+            av_frame_move_ref(slot->frame, frame);
+            slot->seq = decodedFrames++;
+            slot->epoch = epoch;
+            slot->end = false;
+            decoded.push();
+        }
+    }
+    void decodeStage(void) {
+        tracer.thread("decode");
+        AVPacket packet;
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+
+        AVFrame* frame = av_frame_alloc();
+        bool ok = true;
+        keyframes.seeked(); // started over by a loop
+        while(ok && !halted())
+        {
+            if(seekPending)
+                seek();
+            if(av_read_frame(av.formatContext, &packet) < 0)
+                break;
+            if(packet.stream_index != av.videoStreamIndex) {
+                av_packet_unref(&packet);
+                continue;
+            }
+            const int64_t ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+            keyframes.packet(ts, packet.pos, packet.flags & AV_PKT_FLAG_KEY);
+
+            if(catchUp >= 0 && nearTarget(ts)) {
+                // whatever lands on the target is decoded in full, even a non-reference frame
+                av.codecContext->skip_frame = AVDISCARD_DEFAULT;
+                av.codecContext->skip_loop_filter = AVDISCARD_DEFAULT;
+            }
+            applySkipLevel();
+            const unsigned seq = decodedFrames, size = packet.size;
+            tracer.begin(TRACE_DECODE, seq, size);
+            int ret = avcodec_send_packet(av.codecContext, &packet);
+            // AVERROR(EAGAIN) means the decoder wants its output read first
+            while(ret == AVERROR(EAGAIN) && (ok = receiveFrames(frame)) && !seekPending)
+                ret = avcodec_send_packet(av.codecContext, &packet);
+            av_packet_unref(&packet);
+
+            if(ret == AVERROR_EOF || ret == AVERROR(EINVAL)) {
+                fprintf(stderr, "AVERROR(EAGAIN): %d, AVERROR_EOF: %d, AVERROR(EINVAL): %d\n", AVERROR(EAGAIN), AVERROR_EOF, AVERROR(EINVAL));
+                fprintf(stderr, "fe_read_frame: Frame getting error (%d)!\n", ret);
+                fail();
+                break;
+            } else if(ret < 0 && ret != AVERROR(EAGAIN)) {
+                logger.log("Skipping undecodable packet");
+                tracer.end(TRACE_DECODE, seq, size);
+                continue;
+            }
+
+            ok = ok && receiveFrames(frame);
+            tracer.end(TRACE_DECODE, seq, size);
+        }
+
+        // collect the frames the decoder is still holding back
+        if(ok && !halted() && avcodec_send_packet(av.codecContext, NULL) >= 0)
+            receiveFrames(frame);
+        // and leave it ready to decode again after a loop seek
+        avcodec_flush_buffers(av.codecContext);
+        av_frame_free(&frame);
+
+        auto slot = ring_wait([this]{ return decoded.writeSlot(); }, [this]{ return halted(); });
+        if(slot) {
+            slot->end = true;
+            decoded.push();
+        }
+    }
+    void scaleStage(void) {
+        tracer.thread("scale");
+        unsigned current = epoch;
+        for(;;) {
+            auto in = ring_wait([this]{ return decoded.readSlot(); }, [this]{ return halted(); });
+            if(!in)
+                return;
+            if(!in->end && in->epoch != epoch) { // from before a seek
+                av_frame_unref(in->frame);
+                decoded.pop();
+                continue;
+            }
+            if(!in->end && in->epoch != current) {
+                current = in->epoch;
+                scheduler.reset();
+            }
+
+            clk::time_point due;
+            double pts = 0;
+            if(!in->end) {
+                pts = presentationTime(in->frame);
+                due = scheduler.deadline(pts);
+                // already too late to show, and there is a newer frame to show instead
+                auto next = decoded.peekSlot(1);
+                if(realtime() && Scheduler::late(scheduler.shifted(due), clk::now()) && next && !next->end) {
+                    scheduler.drop();
+                    tracer.instant(TRACE_DROP, in->seq);
+                    av_frame_unref(in->frame);
+                    decoded.pop();
+                    continue;
+                }
+                if(adapt.active()) {
+                    unsigned step = adapt.step();
+                    if(step != qualityStep)
+                        applyQuality(step);
+                    // a lower frame rate only goes on with one frame in `rate`
+                    if(++rateCount < adapt.quality(step).rate) {
+                        av_frame_unref(in->frame);
+                        decoded.pop();
+                        continue;
+                    }
+                    rateCount = 0;
+                }
+            }
+
+            auto out = ring_wait([this]{ return quantized.writeSlot(); }, [this]{ return halted(); });
+            if(!out)
+                return;
+
+            bool end = in->end;
+            out->end = end;
+            out->due = due;
+            out->pts = pts;
+            out->seq = in->seq;
+            out->epoch = in->epoch;
+            if(!end) {
+                auto ts = in->frame->best_effort_timestamp;
+                out->position = ts == AV_NOPTS_VALUE ? pts
+                    : ts * av_q2d(av.formatContext->streams[av.videoStreamIndex]->time_base);
+            }
+            if(!end) {
+                unsigned width, height;
+                if(!targetDimensions(in->frame, width, height)) {
+                    fail();
+                    return;
+                }
+                if(adapt.active()) {
+                    unsigned scale = adapt.quality(qualityStep).scale;
+                    width = std::max(1u, width * scale / 100);
+                    height = std::max(1u, height * scale / 100);
+                }
+                out->colorMode = view.colorMode;
+                unsigned pixelHeight = config.half_blocks ? height * 2 : height;
+                tracer.begin(TRACE_SCALE, in->seq);
+                if(!renderFrame(view, in->frame, width, pixelHeight, *out)) {
+                    fail();
+                    return;
+                }
+                tracer.end(TRACE_SCALE, in->seq, width * height);
+                av_frame_unref(in->frame);
+            }
+            decoded.pop();
+            quantized.push();
+            if(end)
+                return;
+        }
+    }
+    // Puts every viewer in the group for its size and colour mode, making groups as needed
+    void groupViewers(const AVFrame* frame) {
+        for(auto& c : server.viewers()) {
+            if(!c->greeted)
+                continue;
+            unsigned width = 0, height = 0;
+            color_mode_t mode = c->hello.colorMode == COLOR_TRUE ? COLOR_TRUE : COLOR_256;
+            uint64_t key = 0; // too small to show anything
+            if(fitDimensions(frame, c->hello.width, c->hello.height, width, height))
+                key = ((uint64_t)width << 32) | ((uint64_t)height << 8) | mode;
+            if(key == c->group)
+                continue;
+            server.regroup(*c, key);
+            if(!key || groups.count(key))
+                continue;
+            auto g = std::make_unique<group_t>();
+            g->width = width;
+            g->height = height;
+            g->view.use(mode);
+            for(FrameEncoder* e : {&g->encoder, &g->full}) {
+                e->halfBlocks = config.half_blocks;
+                e->colorMode = mode;
+            }
+            g->encoder.delta = config.delta;
+            g->full.delta = false;
+            char up[16];
+            int n = height > 1 ? snprintf(up, sizeof(up), "\x1B[%uF", height - 1) : 0;
+            g->frame.up = std::make_shared<const std::string>(up, n);
+            logger.log("Serving " + std::to_string(width) + "x" + std::to_string(height)
+                    + (mode == COLOR_TRUE ? " truecolor" : " 256 color") + " frames");
+            groups[key] = std::move(g);
+        }
+    }
+    /* Renders and encodes a frame for a group, with a full repaint as well
+     * if one of its viewers needs it. Returns false if it can't be scaled.
+     */
+    bool renderGroup(group_t& g, AVFrame* frame, bool full) {
+        unsigned pixelHeight = config.half_blocks ? g.height * 2 : g.height;
+        if(!renderFrame(g.view, frame, g.width, pixelHeight, g.cells))
+            return false;
+        auto run = [this](unsigned count, auto const& fn) { pool.parallelFor(count, fn); };
+        auto delta = std::make_shared<std::string>();
+        g.encoder.begin(g.width, g.height);
+        g.encoder.frame(g.cells.cells.data(), g.width, g.height, run);
+        g.encoder.take(*delta);
+        g.frame.delta = delta;
+        g.frame.full = nullptr;
+        if(full) {
+            auto repaint = std::make_shared<std::string>();
+            g.full.begin(g.width, g.height);
+            g.full.frame(g.cells.cells.data(), g.width, g.height, run);
+            g.full.take(*repaint);
+            g.frame.full = repaint;
+        }
+        return true;
+    }
+    /* Server mode stands in for the scale and output stages: each frame is
+     * rendered once per group of viewers and handed out when it is due,
+     * while the server keeps the sockets going in between.
+     */
+    void serveStage(void) {
+        tracer.thread("serve");
+        for(;;) {
+            decoded_t* in;
+            while(!(in = decoded.readSlot())) {
+                if(halted())
+                    return;
+                if(unsigned left = server.poll(5))
+                    logger.log(std::to_string(left) + " viewers left");
+            }
+            if(in->end)
+                return;
+
+            double pts = presentationTime(in->frame);
+            auto due = scheduler.deadline(pts);
+            auto next = decoded.peekSlot(1);
+            if(Scheduler::late(due, clk::now()) && next && !next->end) {
+                scheduler.drop();
+                tracer.instant(TRACE_DROP, in->seq);
+                av_frame_unref(in->frame);
+                decoded.pop();
+                continue;
+            }
+
+            groupViewers(in->frame);
+            tracer.begin(TRACE_ENCODE, in->seq);
+            for(auto it = groups.begin(); it != groups.end();) {
+                bool used = false, full = false;
+                for(auto& c : server.viewers()) {
+                    if(c->group == it->first) {
+                        used = true;
+                        full = full || FanoutServer::needsFull(*c);
+                    }
+                }
+                if(!used) {
+                    it = groups.erase(it);
+                    continue;
+                }
+                if(!renderGroup(*it->second, in->frame, full)) {
+                    fail();
+                    return;
+                }
+                ++it;
+            }
+            tracer.end(TRACE_ENCODE, in->seq, groups.size());
+            av_frame_unref(in->frame);
+            decoded.pop();
+
+            tracer.begin(TRACE_WAIT, frameNum);
+            for(auto n = clk::now(); n < due && !halted(); n = clk::now())
+                if(unsigned left = server.poll(std::chrono::duration_cast<std::chrono::milliseconds>(due - n).count()))
+                    logger.log(std::to_string(left) + " viewers left");
+            tracer.end(TRACE_WAIT, frameNum);
+            tracer.begin(TRACE_WRITE, frameNum);
+            for(auto& c : server.viewers()) {
+                auto g = groups.find(c->group);
+                if(g != groups.end())
+                    server.publish(*c, g->second->frame);
+            }
+            tracer.end(TRACE_WRITE, frameNum);
+            frameNum++;
+            if(traceRequested.exchange(false))
+                write_trace();
+            if(stop)
+                return;
+        }
+    }
+    void outputStage(void) {
+        auto last = clk::now();
+        unsigned shownEpoch = epoch;
+        for(;;) {
+            auto in = ring_wait([this]{ return quantized.readSlot(); }, [this]{ return halted(); });
+            if(!in || in->end)
+                return;
+            if(in->epoch != epoch) { // from before a seek
+                quantized.pop();
+                continue;
+            }
+            // while paused, the first frame after a seek is still shown
+            if(paused && in->epoch == shownEpoch) {
+                auto since = clk::now();
+                while(paused && !halted() && in->epoch == epoch)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                scheduler.shift(clk::now() - since);
+                if(adapt.active())
+                    adapt.restart(clk::now());
+                continue;
+            }
+
+            auto next = quantized.peekSlot(1);
+            if(realtime() && Scheduler::late(scheduler.shifted(in->due), clk::now()) && next && !next->end) {
+                scheduler.drop();
+                tracer.instant(TRACE_DROP, in->seq);
+                quantized.pop();
+                continue;
+            }
+
+            unsigned width = in->width, height = in->height, seq = in->seq;
+            const unsigned lines = height + (statusLine() ? 1 : 0);
+            tracer.begin(TRACE_ENCODE, seq);
+            encoder.begin(width, height);
+            if(encoder.colorMode != in->colorMode) { // adaptive quality changed it
+                encoder.colorMode = in->colorMode;
+                encoder.invalidate();
+            }
+            // a grid of another size is drawn from the old one's top, with what it doesn't cover cleared
+            const bool regrid = frameNum && shownLines && (width != shownWidth || lines != shownLines);
+            // archived and cached frames leave moving back up to whoever plays them
+            if(frameNum && !archive.isOpen() && !loopCache.isFilling()) {
+                resetFrame(regrid ? shownLines : lines); // move cursor back
+                if(regrid)
+                    encoder.clearBelow();
+            }
+            if(archive.isOpen() && archive.startsChunk())
+                encoder.invalidate();
+
+            encoder.frame(in->cells.data(), width, height, [this](unsigned count, auto const& fn) {
+                pool.parallelFor(count, fn);
+            });
+            tracer.end(TRACE_ENCODE, seq, encoder.size());
+            auto due = scheduler.shifted(in->due);
+            auto pts = in->pts;
+            position = in->position;
+            if(in->epoch != shownEpoch) {
+                shownEpoch = in->epoch;
+                if(loopCache.isFilling()) {
+                    logger.log("Seeked, so this pass isn't cached");
+                    loopCache.drop();
+                }
+                std::lock_guard<std::mutex> lock(seekMutex);
+                if(shownEpoch)
+                    logger.log("Seek took " + std::to_string(
+                                std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - seekRequested).count()
+                                ) + " ms");
+            }
+            quantized.pop();
+            if(realtime()) {
+                tracer.begin(TRACE_WAIT, seq);
+                Scheduler::sleepUntil(due);
+                tracer.end(TRACE_WAIT, seq);
+            }
+            auto writing = clk::now();
+            tracer.begin(TRACE_WRITE, seq);
+            if(archive.isOpen()) {
+                encoder.take(recorded);
+                if(!archive.frame(pts, recorded, width, height)) {
+                    logger.log(std::string("Error writing archive: ") + strerror(errno));
+                    fail();
+                    return;
+                }
+            } else if(recorder.isOpen()) {
+                encoder.take(recorded);
+                if(!recorder.frame(pts, recorded, width, height)) {
+                    logger.log(std::string("Error recording frame: ") + strerror(errno));
+                    fail();
+                    return;
+                }
+            } else if(loopCache.isFilling()) {
+                encoder.take(recorded);
+                if(writeFrame(recorded, width, lines) < 0) {
+                    logger.log(std::string("Error writing frame: ") + strerror(errno));
+                    fail();
+                    return;
+                }
+                if(!loopCache.add(pts, position, recorded, width, height))
+                    logger.log("Clip is too big for the loop cache, every pass is decoded");
+            } else if(encoder.flush(STDOUT_FILENO) < 0) {
+                logger.log(std::string("Error writing frame: ") + strerror(errno));
+                fail();
+                return;
+            }
+            tracer.end(TRACE_WRITE, seq, encoder.lastFrameBytes());
+            shownWidth = width;
+            shownLines = lines;
+
+            frameNum++;
+            auto n = clk::now();
+            if(adapt.active()) {
+                unsigned dropped = scheduler.droppedFrames();
+                if(adapt.wrote(encoder.lastFrameBytes(), std::chrono::duration<double>(n - writing).count(),
+                            dropped - droppedSeen, !loopCache.isFilling(), n))
+                    logQuality();
+                droppedSeen = dropped;
+            }
+            if(realtime() && Scheduler::late(due, n)) {
+                missedFrames++;
+                tracer.instant(TRACE_MISS, seq, std::chrono::duration_cast<std::chrono::microseconds>(n - due).count());
+            } else {
+                scheduler.shown();
+            }
+            if(statusLine())
+                printStatus(last, n, width, height, encoder.lastFrameBytes());
+            if(traceRequested.exchange(false))
+                write_trace();
+            if(stop) // SIGINT
+                return;
         }
     }
   public:
@@ -177,6 +1179,22 @@ class Stream {
         return av.formatContext;
     }
     int readFormat(bool verbose) {
+        if(!input.open(filename)) {
+            logger.log("Error opening `" + filename + "': " + strerror(errno));
+            return 1;
+        }
+        if(input.context()) {
+            av.formatContext = avformat_alloc_context();
+            if(!av.formatContext) {
+                logger.log("Error allocating format context");
+                return 1;
+            }
+            av.formatContext->pb = input.context();
+            av.formatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+            if(input.type() == INPUT_PIPE)
+                av.formatContext->probesize = PIPE_PROBE_BYTES;
+            logger.log(std::string("Reading input as a ") + input.name());
+        }
         int err = avformat_open_input(&av.formatContext, filename.c_str(), NULL, NULL);
         if(err != 0) {
             logger.log("Error reading input from file `" + filename + "'");
@@ -229,129 +1247,289 @@ class Stream {
             logger.log("Unsupported codec");
             return 4;
         }
+        if(config.lowres) {
+            int lowres = std::min<int>(config.lowres, av.codec->max_lowres);
+            av.codecContext->lowres = lowres;
+            if(lowres)
+                logger.log("Decoding at 1/" + std::to_string(1 << lowres) + " resolution");
+            else
+                logger.log("Codec can't decode at lower resolution");
+        }
+        av.codecContext->thread_count = config.decoder_threads;
+        av.codecContext->thread_type = config.decoder_thread_type;
         if(avcodec_open2(av.codecContext, av.codec, &av.dict) < 0) {
             logger.log("Error opening codec");
             return 5;
         }
+        logger.log("Decoding with " + std::to_string(av.codecContext->thread_count) + " threads ("
+                + (av.codecContext->active_thread_type == FF_THREAD_FRAME ? "frame"
+                    : av.codecContext->active_thread_type == FF_THREAD_SLICE ? "slice" : "none") + ")");
         return 0;
     }
 
+    /* Auto colour mode, on a terminal that has truecolor: renders and
+     * encodes the first frame both ways, before the scale thread takes it,
+     * and settles on 256 colors for the session if truecolor writes more
+     * than AUTO_COLOR_BYTES_RATIO times the bytes for it and 256 colors
+     * takes less than AUTO_COLOR_CPU_SHARE of a frame's time.
+     */
+    void chooseColorMode(void) {
+        auto in = ring_wait([this]{ return decoded.readSlot(); }, [this]{ return halted(); });
+        if(!in || in->end)
+            return;
+        unsigned width, height;
+        if(!targetDimensions(in->frame, width, height))
+            return;
+        const unsigned pixelHeight = config.half_blocks ? height * 2 : height;
+        view_t palette;
+        palette.use(COLOR_256);
+        view_t* views[2] = {&view, &palette};
+        size_t bytes[2];
+        double seconds[2];
+        for(unsigned i = 0; i < 2; ++i) {
+            // the first render builds tables that later frames get for free
+            cells_t cells;
+            if(!renderFrame(*views[i], in->frame, width, pixelHeight, cells))
+                return;
+            auto start = clk::now();
+            renderFrame(*views[i], in->frame, width, pixelHeight, cells);
+            FrameEncoder e;
+            e.delta = false;
+            e.halfBlocks = config.half_blocks;
+            e.colorMode = views[i]->colorMode;
+            e.begin(cells.width, cells.height);
+            e.frame(cells.cells.data(), cells.width, cells.height, [this](unsigned count, auto const& fn) {
+                pool.parallelFor(count, fn);
+            });
+            bytes[i] = e.size();
+            seconds[i] = std::chrono::duration<double>(clk::now() - start).count();
+        }
+        const double period = wait_time();
+        const bool fewer = bytes[0] > bytes[1] * AUTO_COLOR_BYTES_RATIO
+            && (period <= 0 || seconds[1] < period * AUTO_COLOR_CPU_SHARE);
+        logger.log("Auto colors: truecolor " + std::to_string(bytes[0]) + " bytes in "
+                + std::to_string((int)(seconds[0] * 1E6)) + " us, 256 colors " + std::to_string(bytes[1]) + " bytes in "
+                + std::to_string((int)(seconds[1] * 1E6)) + " us; using " + (fewer ? "256 colors" : "truecolor"));
+        if(fewer) {
+            config.color_mode = COLOR_256;
+            view.use(COLOR_256);
+            encoder.colorMode = COLOR_256;
+        }
+    }
+    // Gets a pass ready to start
+    void prepare(void) {
+        view.use(config.color_mode);
+        if(adapt.active())
+            applyQuality(adapt.step());
+        rateCount = 0;
+        quantizeYuvRow = select_quantize_yuv_row(quantize_isa);
+
+        decoded.clear();
+        quantized.clear();
+        scheduler.reset();
+        halt = false;
+        failed = false;
+        ended = false;
+    }
+    /* Mosaic: decodes and scales a pass on this stream's own threads,
+     * into grids that fit a `width` by `height` tile, for composite() to
+     * take. The tile can be changed while running.
+     */
+    bool start(unsigned width, unsigned height) {
+        if(av.codec == nullptr) {
+            logger.log("Attempted to display video without reading the codec first");
+            return false;
+        }
+        resize(width, height);
+        prepare();
+        decodeThread = std::thread(&Stream::decodeStage, this);
+        scaleThread = std::thread(&Stream::scaleStage, this);
+        return true;
+    }
+    void resize(unsigned width, unsigned height) {
+        tile = (uint64_t)width << 32 | height;
+    }
+    // Stops the threads start() started. Returns false if the pass failed.
+    bool finish(void) {
+        halt = true;
+        if(decodeThread.joinable())
+            decodeThread.join();
+        if(scaleThread.joinable())
+            scaleThread.join();
+        for(auto& slot : decoded)
+            av_frame_unref(slot.frame);
+        return !failed;
+    }
+    // Mosaic: the pass has been composited to the end
+    bool done(void) const {
+        return ended || failed;
+    }
+    /* Mosaic: copies the newest grid due by `now` into a canvas of
+     * `canvasWidth` cells per row, centred in the `width` by `height` tile
+     * at (x, y), and drops any older ones due by then too. Returns true if
+     * the tile changed.
+     */
+    bool composite(clk::time_point now, uint32_t* canvas, unsigned canvasWidth, unsigned x, unsigned y,
+            unsigned width, unsigned height) {
+        const unsigned rows = config.half_blocks ? 2 : 1;
+        bool changed = false;
+        cells_t* in;
+        while((in = quantized.readSlot())) {
+            if(in->end) {
+                ended = true;
+                break;
+            }
+            if(scheduler.shifted(in->due) > now)
+                break;
+            auto next = quantized.peekSlot(1);
+            if(next && !next->end && scheduler.shifted(next->due) <= now) {
+                scheduler.drop();
+                tracer.instant(TRACE_DROP, in->seq);
+                quantized.pop();
+                continue;
+            }
+            // grids scaled before the tile last changed size are cut to fit
+            unsigned w = std::min(in->width, width), h = std::min(in->height, height);
+            uint32_t* to = canvas + (size_t)(y + (height - h) / 2) * rows * canvasWidth + x + (width - w) / 2;
+            for(unsigned r = 0; r < h * rows; ++r)
+                std::copy_n(in->cells.data() + (size_t)r * in->width, w, to + (size_t)r * canvasWidth);
+            frameNum++;
+            scheduler.shown();
+            quantized.pop();
+            changed = true;
+        }
+        return changed;
+    }
     int display() {
         if(av.codec == nullptr) {
             logger.log("Attempted to display video without reading the codec first");
             return 1;
         }
-        AVFrame* frame = av_frame_alloc();
-
-        AVPacket packet;
-        av_init_packet(&packet);
-        packet.data = NULL;
-        packet.size = 0;
-
-        while(av_read_frame(av.formatContext, &packet) >= 0)
-        {
-            if(packet.stream_index != av.videoStreamIndex) continue;
+        prepare();
 
-            auto start = clk::now();
-            std::chrono::nanoseconds dur((int)(1E9 * wait_time() - SPINLOCK_NS));
-            auto stopt  = start + dur;
-
-            auto avs = clk::now();
-            int ret = 0;
-            // AVERROR(EAGAIN) means that we need to feed more
-            do {
-                do {
-                    ret = avcodec_send_packet(av.codecContext, &packet);
-                } while(ret == AVERROR(EAGAIN));
-
-                if(ret == AVERROR_EOF || ret == AVERROR(EINVAL)) {
-                    fprintf(stderr, "AVERROR(EAGAIN): %d, AVERROR_EOF: %d, AVERROR(EINVAL): %d\n", AVERROR(EAGAIN), AVERROR_EOF, AVERROR(EINVAL));
-                    fprintf(stderr, "fe_read_frame: Frame getting error (%d)!\n", ret);
-                    return 1;
-                }
+        if(loopCache.isComplete() && replay()) {
+            puts("");
+            return failed ? 1 : 0;
+        }
+        halt = false;
+        // cache a whole pass from the start, when there will be another
+        if(config.loop && !offline() && !serving() && !loopCache.isComplete() && !seekPending) {
+            loopCache.begin((size_t)config.loop_cache_mb << 20, getTTYDimensions());
+            encoder.invalidate(); // the first cached frame has to stand on its own
+        }
 
-                ret = avcodec_receive_frame(av.codecContext, frame);
-            } while(ret == AVERROR(EAGAIN));
+        decodeThread = std::thread(&Stream::decodeStage, this);
+        if(config.detect_color_mode && !offline() && !serving()) {
+            if(config.color_mode == COLOR_TRUE)
+                chooseColorMode();
+            config.detect_color_mode = false; // once a session
+        }
+        auto start = clk::now();
+        unsigned startFrame = frameNum;
+        if(adapt.active())
+            adapt.restart(start);
+        else if(realtime() && config.adapt)
+            adapt.begin(config.color_mode == COLOR_TRUE, config.truecolor_bits, config.budget_kib * 1024.0, start);
+        std::thread inputThread;
+        if(!serving())
+            scaleThread = std::thread(&Stream::scaleStage, this);
+        if(realtime() && isatty(STDIN_FILENO))
+            inputThread = std::thread(&Stream::inputStage, this);
+        if(serving())
+            serveStage();
+        else
+            outputStage();
+        bool finished = !halted();
+        halt = true;
+        decodeThread.join();
+        if(scaleThread.joinable())
+            scaleThread.join();
+        if(inputThread.joinable())
+            inputThread.join();
 
-            auto [ tty_width, tty_height ] = getTTYDimensions();
-            if(config.verbose)
-                tty_height -= 1;
+        // drop whatever was still in flight
+        for(auto& slot : decoded)
+            av_frame_unref(slot.frame);
 
-            auto height = config.height < 0 ? tty_height : config.height;
-            auto width  = config.width  < 0 ? tty_width  : config.width;
-            float aspect = (float)(frame->height)/frame->width * PIXEL_ASPECT_RATIO;
-            if(config.height < 0 && config.width < 0) {
-                if((unsigned)round(aspect * width) > height) {
-                    // width is too great
-                    width = (unsigned)(height/aspect);
-                } else {
-                    // height is too great
-                    height = (unsigned)(aspect * width);
-                }
+        if(loopCache.isFilling()) {
+            if(finished) {
+                loopCache.finish();
+                logger.log("Cached " + std::to_string(loopCache.size()) + " frames (" + std::to_string(loopCache.sizeBytes())
+                        + " bytes) for looping");
             } else {
-                if(config.height >= 0)
-                    if(config.width < 0)
-                        width = (unsigned)(height/aspect);
-                if(config.height < 0)
-                    if(config.width >= 0)
-                        height = (unsigned)(width*aspect);
+                loopCache.drop();
             }
+        }
 
-            if(height <= 0 || width <= 0) {
-                std::cerr << "Got invalid dimensions" << std::endl;
-                return 1;
-            }
-
-            if(frameNum) {
-                resetFrame(height + (config.verbose ? 1 : 0)); // move cursor back
-            }
-
-            auto ave = clk::now();
-            logger.log("Took " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(ave-avs).count()) + " ms to decode");
-
-            if(config.verbose)
-                logger.log("Rendering frame " + std::to_string(frameNum));
-
-            auto nf = convert(frame, width, height);
-            render(nf);
-            av_frame_unref(nf);
-            if(config.verbose)
-                logger.log("Rendered frame " + std::to_string(frameNum));
-
-            frameNum++;
-            av_packet_unref(&packet);
-            auto n = clk::now();
-            if(stopt < n) {
-                logger.log("Missed frame by " + std::to_string(
-                            std::chrono::duration_cast<std::chrono::milliseconds>(n - stopt).count()
-                            ) + "ms");
-            }
-            if(istty) {
-                std::this_thread::sleep_until(stopt);
-                while(stopt + std::chrono::nanoseconds((int)SPINLOCK_NS) > clk::now()); // accurate waiting
-            }
-            if(config.verbose) {
-                n = clk::now();
-                std::cout << "\n file: " + config.filename + " | fps (des): " + std::to_string(1.0/wait_time())
-                    + " | fps (act): " + std::to_string(1.0E9/std::chrono::duration_cast<std::chrono::nanoseconds>(n - start).count())
-                    + " | height: " + std::to_string(height) + " | width: " + std::to_string(width) + "   ";
+        if(offline()) {
+            double seconds = std::chrono::duration<double>(clk::now() - start).count();
+            std::string rate = (archive.isOpen() ? "Compiled " : "Recorded ") + std::to_string(frameNum - startFrame)
+                + " frames in " + std::to_string(seconds) + " s (" + std::to_string((frameNum - startFrame) / seconds)
+                + " frames/s)";
+            logger.log(rate);
+            std::cerr << rate << std::endl;
+            if(!recorder.close() || !archive.close()) {
+                logger.log(std::string("Error finishing output file: ") + strerror(errno));
+                failed = true;
             }
-            if(stop) // SIGINT
-                goto done;
-
+        } else if(!serving()) {
+            puts("");
         }
-done:
-        puts("");
         logger.log("Finished displaying");
-        av_packet_unref(&packet);
-        av_frame_unref(frame);
+        if(encoder.framesWritten())
+            logger.log("Wrote " + std::to_string(encoder.bytesWritten()) + " bytes in " + std::to_string(encoder.framesWritten())
+                    + " frames (" + std::to_string(encoder.bytesWritten() / encoder.framesWritten()) + " bytes/frame, "
+                    + std::to_string(encoder.deltaFramesEncoded()) + " delta)");
+        if(scheduler.droppedFrames())
+            logger.log("Dropped " + std::to_string(scheduler.droppedFrames()) + " late frames");
+        if(missedFrames)
+            logger.log("Missed " + std::to_string(missedFrames) + " frame deadlines");
+        return failed ? 1 : 0;
+    }
+    // Sends frames to a file instead of stdout. Returns 1 if it can't be created.
+    int record(std::string const& path) {
+        if(!recorder.open(path)) {
+            logger.log("Error creating recording `" + path + "': " + strerror(errno));
+            return 1;
+        }
+        logger.log("Recording to `" + path + "' as "
+                + (Recorder::formatFor(path) == RECORD_ASCIICAST ? "asciicast" : "ttyrec"));
         return 0;
     }
-    Stream(config_t const& c) : pad(c.pad), filename(c.filename) {
+    // True if another pass can be played from the loop cache, without rewinding the input
+    bool cached(void) const {
+        return loopCache.isComplete();
+    }
+    // Serves frames to viewers on a Unix socket. Returns 1 if it can't listen there.
+    int serve(std::string const& path) {
+        if(!server.open(path)) {
+            logger.log("Error listening on `" + path + "': " + strerror(errno));
+            return 1;
+        }
+        logger.log("Serving on `" + path + "'");
+        return 0;
+    }
+    // Sends frames to an archive for later playback. Returns 1 if it can't be created.
+    int compile(std::string const& path) {
+        if(!archive.open(path, config.color_mode, config.half_blocks)) {
+            logger.log("Error creating archive `" + path + "': " + strerror(errno));
+            return 1;
+        }
+        logger.log("Compiling to `" + path + "'");
+        return 0;
+    }
+    Stream(config_t const& c) : pad(c.pad), pool(c.render_threads), filename(c.filename) {
         logger.log("Initializing stream");
+        encoder.delta = c.delta;
+        encoder.halfBlocks = c.half_blocks;
+        encoder.colorMode = c.color_mode;
+        for(auto& slot : decoded)
+            slot.frame = av_frame_alloc();
     }
     ~Stream(void) {
         logger.log("Destructing stream");
+        for(auto& slot : decoded)
+            av_frame_free(&slot.frame);
         if(av.formatContext) {
             avformat_close_input(&av.formatContext);
         }
@@ -359,9 +1537,6 @@ done:
             avcodec_close(av.codecContext);
             // av_free(av.codec);
         }
-        if(av.swsContext != nullptr) {
-            sws_freeContext(av.swsContext);
-        }
         logger.log("Stream destroyed");
     }
 };
@@ -386,18 +1561,238 @@ static std::unordered_map<std::string, std::function<Interrupt_t(int&, int, char
             return CONTINUE;
         }
     },
+    {"-d", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                std::string arg{argv[i]};
+                if(arg == "none")
+                    config.dither = DITHER_NONE;
+                else if(arg == "ordered")
+                    config.dither = DITHER_ORDERED;
+                else if(arg == "fs")
+                    config.dither = DITHER_FS;
+                else
+                    return ERROR;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-dt", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                std::string arg{argv[i]};
+                if(arg == "auto") {
+                    config.decoder_threads = 0;
+                } else {
+                    config.decoder_threads = atoi(argv[i]);
+                    if(std::to_string(config.decoder_threads) != arg || config.decoder_threads <= 0)
+                        return ERROR;
+                }
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-dtype", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                std::string arg{argv[i]};
+                if(arg == "frame")
+                    config.decoder_thread_type = FF_THREAD_FRAME;
+                else if(arg == "slice")
+                    config.decoder_thread_type = FF_THREAD_SLICE;
+                else if(arg == "any")
+                    config.decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+                else
+                    return ERROR;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-j", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                std::string arg{argv[i]};
+                if(arg == "auto") {
+                    config.render_threads = std::max(1u, std::thread::hardware_concurrency());
+                } else {
+                    int n = atoi(argv[i]);
+                    if(std::to_string(n) != arg || n <= 0)
+                        return ERROR;
+                    config.render_threads = n;
+                }
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
     {"-l", [](int&, int, char**, config_t& config)
         {
             config.loop = true;
             return CONTINUE;
         }
     },
+    {"-cache", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                config.loop_cache_mb = atoi(argv[i]);
+                if(std::to_string(config.loop_cache_mb) != argv[i])
+                    return ERROR;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
     {"-fc", [](int&, int, char**, config_t& config)
         {
             config.accurate_colors = false;
             return CONTINUE;
         }
     },
+    {"-nd", [](int&, int, char**, config_t& config)
+        {
+            config.delta = false;
+            return CONTINUE;
+        }
+    },
+    {"-na", [](int&, int, char**, config_t& config)
+        {
+            config.adapt = false;
+            return CONTINUE;
+        }
+    },
+    {"-bw", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                int kib = atoi(argv[i]);
+                if(kib <= 0 || std::to_string(kib) != argv[i])
+                    return ERROR;
+                config.budget_kib = kib;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-c", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                std::string arg{argv[i]};
+                config.detect_color_mode = arg == "auto";
+                if(arg == "256")
+                    config.color_mode = COLOR_256;
+                else if(arg == "true")
+                    config.color_mode = COLOR_TRUE;
+                else if(arg != "auto")
+                    return ERROR;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-sc", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                std::string arg{argv[i]};
+                if(arg == "bicubic")
+                    config.scaling = SCALE_BICUBIC;
+                else if(arg == "box")
+                    config.scaling = SCALE_BOX;
+                else
+                    return ERROR;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-lowres", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                int l = atoi(argv[i]);
+                if(l < 0 || l > 3 || std::to_string(l) != argv[i])
+                    return ERROR;
+                config.lowres = l;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-trace", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc)
+                config.trace_file = argv[i];
+            else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-rec", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc)
+                config.record_file = argv[i];
+            else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-mosaic", [](int&, int, char**, config_t& config)
+        {
+            config.mosaic = true;
+            return CONTINUE;
+        }
+    },
+    {"-serve", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc)
+                config.serve_socket = argv[i];
+            else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-connect", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc)
+                config.connect_socket = argv[i];
+            else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-compile", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc)
+                config.archive_file = argv[i];
+            else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-rgb", [](int&, int, char**, config_t& config)
+        {
+            config.yuv = false;
+            return CONTINUE;
+        }
+    },
+    {"-tb", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                int b = atoi(argv[i]);
+                if(b < 1 || b > 8 || std::to_string(b) != argv[i])
+                    return ERROR;
+                config.truecolor_bits = b;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
+    {"-hb", [](int&, int, char**, config_t& config)
+        {
+            config.half_blocks = true;
+            return CONTINUE;
+        }
+    },
     {"-p", [](int& i, int argc, char** argv, config_t& config)
         {
             if(++i < argc) {
@@ -413,15 +1808,88 @@ static std::unordered_map<std::string, std::function<Interrupt_t(int&, int, char
             return CONTINUE;
         }
     },
+    {"-lut", [](int& i, int argc, char** argv, config_t& config)
+        {
+            if(++i < argc) {
+                int b = atoi(argv[i]);
+                if(b < 0 || b > 8 || std::to_string(b) != argv[i])
+                    return ERROR;
+                config.lut_bits = b;
+            } else
+                return ERROR;
+            return CONTINUE;
+        }
+    },
     {"--help", [](int&, int, char**, config_t&)
         {
-            std::cout << "usage: ttydisp [options] <filename>\n"
+            std::cout << "usage: ttydisp [options] <filename>  (- reads from stdin)\n"
                 << "    --help:\n"
                 << "        Show this help message\n"
+                << "    -c:\n"
+                << "        Set colors to 256, true (24 bit) or auto (default): truecolor if $COLORTERM\n"
+                << "        has it, unless the first frame is much smaller in 256 colors\n"
+                << "    -d:\n"
+                << "        Set dithering for 256 color output to none (default), ordered or fs\n"
+                << "        (Floyd-Steinberg). Ordered is faster and keeps delta output small\n"
+                << "    -dt:\n"
+                << "        Set decoder threads (auto or a count, default auto)\n"
+                << "    -dtype:\n"
+                << "        Set decoder threading to frame, slice or any (default any)\n"
+                << "    -j:\n"
+                << "        Set threads used to quantize and encode each frame (auto or a count,\n"
+                << "        default 1)\n"
                 << "    -l:\n"
                 << "        Enable looping\n"
+                << "    -cache:\n"
+                << "        Set memory in MiB for keeping a looping clip's frames, so passes after\n"
+                << "        the first are only written out (default " << LOOP_CACHE_MB << ", 0 disables)\n"
+                << "    -hb:\n"
+                << "        Draw two pixels per cell with half blocks (double vertical resolution)\n"
                 << "    -fc:\n"
                 << "        Disable accurate colors (might be faster)\n"
+                << "    -lut:\n"
+                << "        Set color table resolution in bits per channel (0-8, 0 disables,\n"
+                << "        8 is exact but slow to build)\n"
+                << "    -rgb:\n"
+                << "        Always convert to RGB before quantizing, even for YUV video\n"
+                << "    -tb:\n"
+                << "        Set bits kept per channel in truecolor mode (1-8, default 8)\n"
+                << "    -sc:\n"
+                << "        Set scaling to bicubic (default) or box (area average, faster when\n"
+                << "        shrinking a lot)\n"
+                << "    -lowres:\n"
+                << "        Have the decoder output 1/2, 1/4 or 1/8 size frames (1-3), if the\n"
+                << "        codec can\n"
+                << "    -rec:\n"
+                << "        Render as fast as possible into a file instead of the terminal, timed\n"
+                << "        by the video's timestamps: asciicast v2 if it ends in .cast, else ttyrec\n"
+                << "    -mosaic:\n"
+                << "        Play every file given at once, in a grid of tiles that fills the\n"
+                << "        terminal (or -w by -h)\n"
+                << "    -serve:\n"
+                << "        Decode once and serve the frames to any number of viewers on a Unix\n"
+                << "        socket, encoded once per terminal size and color mode\n"
+                << "    -connect:\n"
+                << "        Show what a -serve process is serving on a Unix socket, at the size\n"
+                << "        of this terminal (or -w and -h) and with -c colors, instead of a file\n"
+                << "    -compile:\n"
+                << "        Render into an archive that plays back without decoding: pass the\n"
+                << "        archive as the input file to play it. It keeps the colors and half\n"
+                << "        blocks it was compiled with, and a truecolor one only plays with\n"
+                << "        truecolor output (-c true, or auto on a truecolor terminal)\n"
+                << "    -trace:\n"
+                << "        Record a trace of every stage and write it to a file as Chrome trace\n"
+                << "        JSON on exit or SIGUSR1; per stage latencies go to the log and, on\n"
+                << "        exit, to stderr\n"
+                << "    -nd:\n"
+                << "        Disable delta output (repaint every cell of every frame)\n"
+                << "    -na:\n"
+                << "        Disable adaptive quality, which steps colors, grid size and frame\n"
+                << "        rate down while the terminal can't take frames as fast as they come\n"
+                << "        (never above -c, -tb, -w, -h or -f)\n"
+                << "    -bw:\n"
+                << "        Set a budget in KiB/s for adaptive quality to keep output under\n"
+                << "        (default none: only what the terminal takes counts)\n"
                 << "    -p:\n"
                 << "        Set brightness padding\n"
                 << "    -v:\n"
@@ -429,7 +1897,13 @@ static std::unordered_map<std::string, std::function<Interrupt_t(int&, int, char
                 << "    -w:\n"
                 << "        Set output width\n"
                 << "    -h:\n"
-                << "        Set output height\n";
+                << "        Set output height\n"
+                << "keys, when playing in a terminal:\n"
+                << "    space, p: pause or resume\n"
+                << "    left/right, h/l: seek back/forward " << SEEK_SECONDS << " seconds\n"
+                << "    down/up, j/k: seek back/forward " << SEEK_LONG_SECONDS << " seconds\n"
+                << "    0-9: seek to 0% - 90%\n"
+                << "    q: quit\n";
             return HALT;
         }
     },
@@ -487,7 +1961,7 @@ std::pair<bool, config_t> parseArguments(int argc, char** argv) {
     for(i = 1; i < argc; ++i)
     {
         std::string arg{argv[i]};
-        if(arg[0] == '-') {
+        if(arg[0] == '-' && arg != "-") { // "-" is stdin
             auto func = functionMap.find(arg);
             if(func == functionMap.end()) {
                 std::cerr << "Unknown switch `" << arg << "'" << std::endl;
@@ -506,12 +1980,14 @@ std::pair<bool, config_t> parseArguments(int argc, char** argv) {
         } else {
             if(config.filename.empty())
                 config.filename = std::string{arg};
-            else {
-                std::cerr << "Unrecognized argument `" << arg << "'" << std::endl;
-                break;
-            }
+            else
+                config.mosaic_files.push_back(arg);
         }
     }
+    if(!config.mosaic && !config.mosaic_files.empty()) {
+        std::cerr << "Unrecognized argument `" << config.mosaic_files.front() << "' (more than one file needs -mosaic)" << std::endl;
+        return {false, config};
+    }
 
     if(i < argc) {
         // Argument parser failure
@@ -525,7 +2001,8 @@ std::pair<bool, config_t> parseArguments(int argc, char** argv) {
         }
     }
 
-    if(!istty) {
+    // a server sizes frames for its viewers' terminals
+    if(!istty && config.serve_socket.empty()) {
         if(config.height < 0 && config.width < 0) {
             logger.log("Output is not a terminal, so custom dimensions must be set");
             return {false, config};
@@ -535,9 +2012,244 @@ std::pair<bool, config_t> parseArguments(int argc, char** argv) {
     return {true, config};
 }
 
+/* Plays a -compile archive. Nothing is decoded, scaled or quantized; a
+ * chunk at a time is inflated and its frames written out on time.
+ */
+int play_archive(std::string const& path) {
+    ArchiveReader reader;
+    if(!reader.open(path)) {
+        logger.log("Error reading archive `" + path + "'");
+        return 1;
+    }
+    logger.log("Playing archive of " + std::to_string(reader.frames()) + " frames in "
+            + std::to_string(reader.chunks()) + " chunks");
+    // the frames are already encoded, so they can't be changed to suit the terminal
+    if(reader.colorMode() == COLOR_TRUE) {
+        if(config.color_mode != COLOR_TRUE) {
+            logger.log("Archive uses truecolor output but the terminal is set to 256 colors (give -c true to play it anyway)");
+            return 1;
+        }
+        logger.log("Archive uses truecolor output");
+    }
+    if(config.half_blocks && !reader.halfBlocks())
+        std::cerr << "Archive was compiled without half blocks, ignoring -hb" << std::endl;
+    else if(reader.halfBlocks())
+        logger.log("Archive uses half blocks");
+
+    Scheduler scheduler;
+    std::vector<char> raw;
+    char up[24];
+    unsigned lastHeight = 0;
+    do {
+        for(unsigned c = 0; c < reader.chunks() && !stop; ++c) {
+            if(!reader.inflate(c, raw)) {
+                logger.log("Archive chunk " + std::to_string(c) + " is corrupt");
+                return 1;
+            }
+            auto const& chunk = reader.chunk(c);
+            for(unsigned i = chunk.firstFrame; i < chunk.firstFrame + chunk.frameCount && !stop; ++i) {
+                auto const& f = reader.frame(i);
+                auto due = scheduler.deadline(f.pts);
+                if(istty)
+                    Scheduler::sleepUntil(due);
+                // clears what's left below, in case this frame is shorter than the last
+                int n = lastHeight > 1 ? snprintf(up, sizeof(up), "\x1B[%uF\x1B[J", lastHeight - 1) : 0;
+                struct iovec v[2] = {{up, (size_t)n}, {raw.data() + f.offset, f.size}};
+                if(write_all(STDOUT_FILENO, v, 2) < 0) {
+                    logger.log(std::string("Error writing frame: ") + strerror(errno));
+                    return 1;
+                }
+                lastHeight = f.height;
+            }
+        }
+    } while(config.loop && !stop);
+    puts("");
+    return 0;
+}
+
+/* Plays several streams at once, each in a tile of one grid. Every stream
+ * decodes and scales on its own threads. Each tick the newest due frame of
+ * every stream that has one is copied into its tile, and if any tile
+ * changed the whole grid goes out as one delta update.
+ */
+int play_mosaic(std::vector<Stream*> const& streams) {
+    const unsigned n = streams.size();
+    const unsigned cols = ceil(sqrt(n)), rows = (n + cols - 1) / cols;
+    const unsigned pixelRows = config.half_blocks ? 2 : 1;
+    FrameEncoder encoder;
+    encoder.delta = config.delta;
+    encoder.halfBlocks = config.half_blocks;
+    encoder.colorMode = config.color_mode;
+    ThreadPool pool(config.render_threads);
+    std::vector<uint32_t> canvas;
+    unsigned width = 0, height = 0, tileWidth = 0, tileHeight = 0;
+
+    // Lays the tiles out again if the terminal changed size. Returns false if they don't fit.
+    auto layout = [&](bool& changed) {
+        auto [ tty_width, tty_height ] = getTTYDimensions();
+        unsigned w = config.width < 0 ? tty_width : config.width;
+        unsigned h = config.height < 0 ? tty_height : config.height;
+        changed = w != width || h != height;
+        if(!changed)
+            return true;
+        // a blank column and row between tiles
+        if(w < cols * 2 || h < rows * 2)
+            return false;
+        width = w;
+        height = h;
+        tileWidth = (width - (cols - 1)) / cols;
+        tileHeight = (height - (rows - 1)) / rows;
+        canvas.assign((size_t)width * height * pixelRows, 0);
+        for(auto s : streams)
+            s->resize(tileWidth, tileHeight);
+        logger.log("Mosaic of " + std::to_string(cols) + "x" + std::to_string(rows) + " tiles of "
+                + std::to_string(tileWidth) + "x" + std::to_string(tileHeight));
+        return true;
+    };
+
+    bool changed;
+    if(!layout(changed)) {
+        logger.log("Terminal is too small for " + std::to_string(n) + " tiles");
+        return 1;
+    }
+    for(auto s : streams)
+        if(!s->start(tileWidth, tileHeight))
+            return 1;
+
+    const auto tick = std::chrono::duration_cast<clk::duration>(
+            std::chrono::duration<double>(1.0 / (config.fps ? config.fps : MOSAIC_FPS)));
+    std::vector<bool> over(n, false); // ended and not looping again
+    bool first = true;
+    int ret = 0;
+    auto next = clk::now();
+    while(!stop) {
+        if(!layout(changed)) {
+            logger.log("Terminal is too small for " + std::to_string(n) + " tiles");
+            ret = 1;
+            break;
+        }
+        bool dirty = changed, running = false;
+        auto now = clk::now();
+        for(unsigned i = 0; i < n; ++i) {
+            Stream& s = *streams[i];
+            if(s.done() && !over[i]) {
+                over[i] = !s.finish() || !config.loop
+                    || av_seek_frame(s.getFormatContext(), -1, 0, AVSEEK_FLAG_FRAME) < 0
+                    || !s.start(tileWidth, tileHeight);
+            }
+            running = running || !over[i];
+            dirty = s.composite(now, canvas.data(), width, i % cols * (tileWidth + 1), i / cols * (tileHeight + 1),
+                    tileWidth, tileHeight) || dirty;
+        }
+        if(dirty) {
+            encoder.begin(width, height);
+            if(changed) {
+                encoder.invalidate();
+                fputs("\x1B[2J\x1B[H", stdout); // written ahead of the frame by flush()
+            } else if(!first) {
+                encoder.cursorUp(height - 1);
+            }
+            encoder.frame(canvas.data(), width, height, [&pool](unsigned count, auto const& fn) {
+                pool.parallelFor(count, fn);
+            });
+            if(encoder.flush(STDOUT_FILENO) < 0) {
+                logger.log(std::string("Error writing frame: ") + strerror(errno));
+                ret = 1;
+                break;
+            }
+            first = false;
+        }
+        if(!running)
+            break;
+        next = std::max(next + tick, clk::now());
+        Scheduler::sleepUntil(next);
+    }
+    for(auto s : streams)
+        if(!s->finish())
+            ret = 1;
+    puts("");
+    if(encoder.framesWritten())
+        logger.log("Wrote " + std::to_string(encoder.bytesWritten()) + " bytes in " + std::to_string(encoder.framesWritten())
+                + " mosaic updates (" + std::to_string(encoder.bytesWritten() / encoder.framesWritten()) + " bytes/update, "
+                + std::to_string(encoder.deltaFramesEncoded()) + " delta)");
+    return ret;
+}
+
+/* Viewer for a -serve process: tells it the terminal size and colour mode,
+ * again after every resize, and copies what comes back to stdout.
+ */
+int run_client(std::string const& path) {
+    struct sockaddr_un addr = {};
+    if(path.size() >= sizeof(addr.sun_path)) {
+        logger.log("Socket path `" + path + "' is too long");
+        return 1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        logger.log("Error connecting to `" + path + "': " + strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return 1;
+    }
+    logger.log("Connected to `" + path + "'");
+
+    auto greet = [fd]() {
+        auto [ width, height ] = getTTYDimensions();
+        hello_t hello = {};
+        memcpy(hello.magic, SERVE_MAGIC, sizeof(SERVE_MAGIC));
+        hello.width = std::min<unsigned>(config.width < 0 ? width : config.width, UINT16_MAX);
+        hello.height = std::min<unsigned>(config.height < 0 ? height : config.height, UINT16_MAX);
+        hello.colorMode = config.color_mode;
+        struct iovec v = {&hello, sizeof(hello)};
+        return write_all(fd, &v, 1);
+    };
+    int ret = 0;
+    std::vector<char> buffer(1 << 16);
+    struct pollfd in = {fd, POLLIN, 0};
+    while(!stop) {
+        if(resized && greet() < 0) {
+            logger.log(std::string("Error writing to server: ") + strerror(errno));
+            ret = 1;
+            break;
+        }
+        if(poll(&in, 1, 100) <= 0)
+            continue;
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            if(n < 0) {
+                logger.log(std::string("Error reading from server: ") + strerror(errno));
+                ret = 1;
+            } else {
+                logger.log("Server closed the connection");
+            }
+            break;
+        }
+        struct iovec v = {buffer.data(), (size_t)n};
+        if(write_all(STDOUT_FILENO, &v, 1) < 0) {
+            logger.log(std::string("Error writing frame: ") + strerror(errno));
+            ret = 1;
+            break;
+        }
+    }
+    close(fd);
+    puts("");
+    return ret;
+}
+
 void interrupt_handler(int) {
     stop = true;
-    logger.log("Got SIGINT. Exiting...");
+}
+
+void resize_handler(int) {
+    resized = true;
+}
+
+void trace_handler(int) {
+    traceRequested = true;
 }
 
 void log(void*, int level, const char *fmt, va_list vargs) {
@@ -555,6 +2267,7 @@ void restore(void) {
     tcsetattr(STDIN_FILENO, TCSANOW, &saved);
 }
 
+// Also turns off line buffering, so that keys reach the controls as they are typed
 void disable_echo() {
     struct termios attributes;
 
@@ -562,7 +2275,9 @@ void disable_echo() {
     atexit(restore);
 
     tcgetattr(STDIN_FILENO, &attributes);
-    attributes.c_lflag &= ~ ECHO;
+    attributes.c_lflag &= ~(ECHO | ICANON);
+    attributes.c_cc[VMIN] = 1;
+    attributes.c_cc[VTIME] = 0;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &attributes);
 }
 
@@ -582,12 +2297,35 @@ int main(int argc, char** argv) {
         logger.verbose = true;
     }
 
+    if(config.detect_color_mode) {
+        const char* colorterm = getenv("COLORTERM");
+        std::string ct{colorterm ? colorterm : ""};
+        config.color_mode = ct == "truecolor" || ct == "24bit" ? COLOR_TRUE : COLOR_256;
+    }
+
+    if(!config.connect_socket.empty()) {
+        signal(SIGINT, interrupt_handler);
+        signal(SIGWINCH, resize_handler);
+        int err = run_client(config.connect_socket);
+        if(err)
+            logger.dump(std::cerr);
+        return err;
+    }
+
     if(config.filename.empty()) {
         std::cout << "No file specified" << std::endl;
         return 1;
     }
     logger.log("Reading from file `" + config.filename + "'");
 
+    if(archive_probe(config.filename)) {
+        signal(SIGINT, interrupt_handler);
+        int err = play_archive(config.filename);
+        if(err)
+            logger.dump(std::cerr);
+        return err;
+    }
+
     Stream stream{config};
     logger.log("Starting reading");
 
@@ -605,15 +2343,107 @@ int main(int argc, char** argv) {
         return 1;
     }
     logger.log("Finished reading video codec");
+    if((!config.record_file.empty()) + (!config.archive_file.empty()) + (!config.serve_socket.empty()) + config.mosaic > 1) {
+        std::cerr << "Only one of -rec, -compile, -serve and -mosaic can be given" << '\n';
+        return 1;
+    }
+    // the first file is `stream`, the rest get tiles of their own
+    std::vector<std::unique_ptr<Stream>> tiles;
+    for(auto const& file : config.mosaic_files) {
+        config_t c = config;
+        c.filename = file;
+        tiles.emplace_back(new Stream{c});
+        logger.log("Reading from file `" + file + "'");
+        if(tiles.back()->readFormat(config.verbose) || tiles.back()->readVideoCodec()) {
+            std::cerr << "Error reading `" << file << "'" << '\n';
+            logger.dump(std::cerr);
+            return 1;
+        }
+    }
+    if(!config.serve_socket.empty() && stream.serve(config.serve_socket)) {
+        std::cerr << "Error starting server" << '\n';
+        logger.dump(std::cerr);
+        return 1;
+    }
+    if(!config.archive_file.empty()) {
+        if(stream.compile(config.archive_file)) {
+            std::cerr << "Error creating archive" << '\n';
+            logger.dump(std::cerr);
+            return 1;
+        }
+        if(config.loop) {
+            logger.log("Looping is off while compiling");
+            config.loop = false;
+        }
+    }
+    if(!config.record_file.empty()) {
+        if(stream.record(config.record_file)) {
+            std::cerr << "Error creating recording" << '\n';
+            logger.dump(std::cerr);
+            return 1;
+        }
+        if(config.loop) {
+            logger.log("Looping is off while recording");
+            config.loop = false;
+        }
+    }
+    logger.log(std::string("Using ") + quantize_isa_name(quantize_isa) + " quantization kernels");
+
+    // a server renders in whichever mode each viewer asks for
+    if(!config.serve_socket.empty()) {
+        build_truecolor_levels(config.truecolor_bits, config.pad);
+        if(config.accurate_colors)
+            color_lut.build(config.lut_bits);
+    } else if(config.color_mode == COLOR_TRUE) {
+        build_truecolor_levels(config.truecolor_bits, config.pad);
+        logger.log("Using truecolor output with " + std::to_string(config.truecolor_bits) + " bits per channel");
+        if(config.dither != DITHER_NONE)
+            logger.log("Dithering only applies to 256 color output");
+        // adaptive quality may step down to 256 colors, and auto mode may pick them
+        if(config.accurate_colors && ((config.adapt && istty) || config.detect_color_mode))
+            color_lut.build(config.lut_bits);
+    } else if(config.accurate_colors) {
+        auto start = clk::now();
+        color_lut.build(config.lut_bits);
+        logger.log("Built " + std::to_string(config.lut_bits) + " bit color table in " + std::to_string(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - start).count()
+                    ) + " ms");
+    }
+
+    if(config.dither == DITHER_ORDERED)
+        build_ordered_dither(DITHER_SPREAD);
+
+    if(!config.trace_file.empty()) {
+        tracer.enabled = true;
+        tracer.thread("output");
+        signal(SIGUSR1, trace_handler);
+    }
 
     // Capture SIGINT, finish the frame
     signal(SIGINT, interrupt_handler);
+    signal(SIGWINCH, resize_handler);
 
     int ret;
-    do {
-        ret = stream.display();
-        av_seek_frame(stream.getFormatContext(), -1, 0, AVSEEK_FLAG_FRAME);
-    } while(config.loop && !ret && !stop);
+    if(config.mosaic) {
+        std::vector<Stream*> streams{&stream};
+        for(auto& t : tiles)
+            streams.push_back(t.get());
+        ret = play_mosaic(streams);
+    } else {
+        do {
+            ret = stream.display();
+            // pipes can't be rewound, so only a cached clip loops
+            if(av_seek_frame(stream.getFormatContext(), -1, 0, AVSEEK_FLAG_FRAME) < 0 && config.loop && !stream.cached()) {
+                if(!ret && !stop)
+                    logger.log("Input can't be rewound, so it plays once");
+                break;
+            }
+        } while(config.loop && !ret && !stop);
+    }
+    if(stop)
+        logger.log("Got SIGINT. Exiting...");
+    if(tracer.enabled)
+        write_trace(&std::cerr);
 
     return 0;
 }
@@ -0,0 +1,220 @@
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/* YUV quantization path.
+ *
+ * Sources that decode to planar 8-bit YUV are scaled to YUV444P and turned
+ * straight into palette cells through a table indexed by (Y, U, V), skipping
+ * the conversion to RGB. The table is built for the frame's matrix and range,
+ * and swscale is told where the chroma samples sit, so colors come out the
+ * same as they would through RGB. Box scaling averages chroma without regard
+ * to its siting (see boxscale.h) and logs that when it takes a YUV source.
+ */
+
+static bool yuv_source(int format) {
+    const AVPixFmtDescriptor* d = av_pix_fmt_desc_get((AVPixelFormat)format);
+    if(!d || d->nb_components < 3)
+        return false;
+    if(d->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL))
+        return false;
+    return (d->flags & AV_PIX_FMT_FLAG_PLANAR) && d->comp[0].depth == 8;
+}
+
+static bool yuv_full_range(const AVFrame* frame) {
+    switch(frame->format) {
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUVJ422P:
+        case AV_PIX_FMT_YUVJ444P:
+            return true;
+        default:
+            return frame->color_range == AVCOL_RANGE_JPEG;
+    }
+}
+
+// Untagged video is taken to be BT.709 from 720 lines up and BT.601 below
+static AVColorSpace yuv_matrix(const AVFrame* frame) {
+    switch(frame->colorspace) {
+        case AVCOL_SPC_BT709:
+        case AVCOL_SPC_FCC:
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+        case AVCOL_SPC_SMPTE240M:
+        case AVCOL_SPC_BT2020_NCL:
+            return frame->colorspace;
+        default:
+            return frame->height >= 720 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+    }
+}
+
+static const char* yuv_matrix_name(AVColorSpace matrix) {
+    switch(matrix) {
+        case AVCOL_SPC_BT709: return "bt709";
+        case AVCOL_SPC_FCC: return "fcc";
+        case AVCOL_SPC_SMPTE240M: return "smpte240m";
+        case AVCOL_SPC_BT2020_NCL: return "bt2020";
+        default: return "bt601";
+    }
+}
+
+static void yuv_coefficients(AVColorSpace matrix, double& kr, double& kb) {
+    switch(matrix) {
+        case AVCOL_SPC_BT709: kr = 0.2126; kb = 0.0722; break;
+        case AVCOL_SPC_FCC: kr = 0.30; kb = 0.11; break;
+        case AVCOL_SPC_SMPTE240M: kr = 0.212; kb = 0.087; break;
+        case AVCOL_SPC_BT2020_NCL: kr = 0.2627; kb = 0.0593; break;
+        default: kr = 0.299; kb = 0.114; break;
+    }
+}
+
+/* Table from (Y, U, V), each truncated to `bits` bits, to a palette cell.
+ * Every bucket stores the color for the bucket's midpoint, converted to
+ * RGB: the exact closest one for accurate colors, never the RGB table's
+ * bucket for it, which would quantize twice; or quantize_fast() with the
+ * padding.
+ */
+class YuvLUT {
+  private:
+    std::vector<uint8_t> table;
+    unsigned bits = 0;
+    unsigned shift = 8;
+    struct {
+        AVColorSpace matrix = AVCOL_SPC_UNSPECIFIED;
+        bool full = false, accurate = false;
+        uint8_t pad = 0;
+        unsigned bits = 0;
+    } key;
+
+    static uint8_t channel(double v) {
+        long c = lround(v * 255);
+        return c < 0 ? 0 : c > 255 ? 255 : c;
+    }
+
+  public:
+    unsigned resolution(void) const { return bits; }
+    unsigned precision_shift(void) const { return shift; }
+    const uint8_t* data(void) const { return table.data(); }
+
+    // Returns true if the table had to be (re)built
+    bool build(unsigned b, AVColorSpace matrix, bool full, bool accurate, uint8_t pad) {
+        if(accurate)
+            pad = 0;
+        if(!table.empty() && key.matrix == matrix && key.full == full && key.accurate == accurate
+                && key.pad == pad && key.bits == b)
+            return false;
+        key.matrix = matrix;
+        key.full = full;
+        key.accurate = accurate;
+        key.pad = pad;
+        key.bits = b;
+
+        bits = b;
+        shift = 8 - b;
+        const unsigned n = 1u << b;
+        table.resize((size_t)n * n * n + 3); // room for 32-bit gathers off the end
+
+        double kr, kb;
+        yuv_coefficients(matrix, kr, kb);
+        const double kg = 1 - kr - kb;
+        const double yOffset = full ? 0 : 16, yScale = full ? 255 : 219, cScale = full ? 255 : 224;
+
+        uint8_t* out = table.data();
+        for(unsigned yi = 0; yi < n; ++yi) {
+            double y = (((yi << shift) + (1u << shift >> 1)) - yOffset) / yScale;
+            for(unsigned ui = 0; ui < n; ++ui) {
+                double cb = (((ui << shift) + (1u << shift >> 1)) - 128.0) / cScale;
+                for(unsigned vi = 0; vi < n; ++vi) {
+                    double cr = (((vi << shift) + (1u << shift >> 1)) - 128.0) / cScale;
+                    double r = y + 2 * (1 - kr) * cr;
+                    double bl = y + 2 * (1 - kb) * cb;
+                    double g = (y - kr * r - kb * bl) / kg;
+                    uint8_t R = channel(r), G = channel(g), B = channel(bl);
+                    *out++ = accurate ? closest_color(R, G, B) : quantize_fast(R, G, B, pad);
+                }
+            }
+        }
+        return true;
+    }
+
+    uint8_t lookup(uint8_t y, uint8_t u, uint8_t v) const {
+        return table[(((size_t)(y >> shift) << bits | (u >> shift)) << bits) | (v >> shift)];
+    }
+};
+
+/* Fixed point YUV -> RGB24 for a row, for the paths that need RGB after
+ * averaging YUV (truecolor, dithering).
+ */
+class YuvToRgb {
+  private:
+    int yOffset = 16, yScale = 0, rv = 0, gu = 0, gv = 0, bu = 0; // 16.16
+
+    static uint8_t clamp(int v) {
+        v = (v + (1 << 15)) >> 16;
+        return v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+
+  public:
+    void build(AVColorSpace matrix, bool full) {
+        double kr, kb;
+        yuv_coefficients(matrix, kr, kb);
+        const double kg = 1 - kr - kb;
+        const double ys = full ? 1.0 : 255.0 / 219, cs = full ? 1.0 : 255.0 / 224;
+        yOffset = full ? 0 : 16;
+        yScale = lround(ys * 65536);
+        rv = lround(2 * (1 - kr) * cs * 65536);
+        bu = lround(2 * (1 - kb) * cs * 65536);
+        gu = lround(2 * kb * (1 - kb) / kg * cs * 65536);
+        gv = lround(2 * kr * (1 - kr) / kg * cs * 65536);
+    }
+
+    void row(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* rgb, unsigned width) const {
+        for(unsigned x = 0; x < width; ++x, rgb += 3) {
+            int Y = (y[x] - yOffset) * yScale, U = u[x] - 128, V = v[x] - 128;
+            rgb[0] = clamp(Y + rv * V);
+            rgb[1] = clamp(Y - gu * U - gv * V);
+            rgb[2] = clamp(Y + bu * U);
+        }
+    }
+};
+
+static void quantize_row_yuv_scalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint32_t* out, unsigned width,
+        YuvLUT const& lut) {
+    for(unsigned x = 0; x < width; ++x)
+        out[x] = lut.lookup(y[x], u[x], v[x]);
+}
+
+#ifdef QUANTIZE_X86
+__attribute__((target("avx2")))
+static void quantize_row_yuv_avx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint32_t* out, unsigned width,
+        YuvLUT const& lut) {
+    const __m128i shift = _mm_cvtsi32_si128(lut.precision_shift());
+    const __m128i ushift = _mm_cvtsi32_si128(lut.resolution());
+    const __m128i yshift = _mm_cvtsi32_si128(2 * lut.resolution());
+    const int* table = (const int*)lut.data();
+    unsigned x = 0;
+    for(; x + 8 <= width; x += 8) {
+        __m256i Y = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(y + x)));
+        __m256i U = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(u + x)));
+        __m256i V = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(v + x)));
+        __m256i i = _mm256_or_si256(_mm256_or_si256(
+                    _mm256_sll_epi32(_mm256_srl_epi32(Y, shift), yshift),
+                    _mm256_sll_epi32(_mm256_srl_epi32(U, shift), ushift)),
+                    _mm256_srl_epi32(V, shift));
+        _mm256_storeu_si256((__m256i*)(out + x), _mm256_and_si256(_mm256_i32gather_epi32(table, i, 1), _mm256_set1_epi32(0xFF)));
+    }
+    quantize_row_yuv_scalar(y + x, u + x, v + x, out + x, width - x, lut);
+}
+#endif
+
+typedef void (*quantize_yuv_row_fn)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint32_t* out, unsigned width,
+        YuvLUT const& lut);
+
+static quantize_yuv_row_fn select_quantize_yuv_row(quantize_isa_t isa) {
+#ifdef QUANTIZE_X86
+    if(isa == ISA_AVX2 || isa == ISA_AVX512)
+        return quantize_row_yuv_avx2;
+#else
+    (void)isa;
+#endif
+    return quantize_row_yuv_scalar;
+}